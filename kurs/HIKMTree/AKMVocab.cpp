@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <fstream>
+
+#include "AKMVocab.hpp"
+#include "Util/threads.hpp"
+#include "Util/util.hpp"
+
+namespace
+{
+	int const MAX_DIMS = 256;
+}
+
+char const AKMVocab::MAGIC[8] = { 'A', 'K', 'M', 'V', 'O', 'C', '0', '1' };
+
+AKMVocab::AKMVocab(Params const & params) :
+	mParams(params),
+	mWords(0)
+{
+	if (params.dims <= 0 || params.dims > MAX_DIMS)
+		throw std::logic_error("AKMVocab dims is out of range");
+}
+
+AKMVocab::AKMVocab(std::string const & fname) :
+	mWords(0)
+{
+	load(fname);
+}
+
+size_t AKMVocab::nearest(SiftDescr const * data, int checks) const
+{
+	float x[MAX_DIMS];
+	std::copy(data, data + mParams.dims, x);
+	return mForest.query(x, checks);
+}
+
+void AKMVocab::index()
+{
+	mForest.build(mCenters.empty() ? 0 : &mCenters.front(), mWords, mParams.dims, mParams.trees, mix(mParams.seed));
+}
+
+void AKMVocab::train(std::vector<SiftDescr> const & data)
+{
+	TRACE;
+
+	int const M = mParams.dims;
+	size_t const N = data.size() / M;
+	if (N == 0)
+		throw std::runtime_error("No descriptors to train the vocabulary on");
+
+	size_t const K = std::min((size_t)mParams.words, N);
+	ThreadPool pool(mParams.threads);
+
+	// centers start at K random descriptors
+	{
+		std::vector<uint32_t> perm(N);
+		for (size_t i = 0; i < N; ++i)
+			perm[i] = i;
+
+		uint64_t state = mix(mParams.seed);
+		mCenters.resize(K * M);
+		for (size_t k = 0; k < K; ++k)
+		{
+			state = mix(state);
+			std::swap(perm[k], perm[k + state % (N - k)]);
+			std::copy(&data[(size_t)perm[k] * M], &data[(size_t)perm[k] * M] + M, &mCenters[k * M]);
+		}
+	}
+	mWords = K;
+
+	std::vector<uint32_t> ids(N, (uint32_t)-1);
+	std::vector<uint32_t> order(N);
+	std::vector<size_t> offs(K + 1);
+
+	for (int iter = 0; iter < mParams.iters; ++iter)
+	{
+		Timer timer;
+		timer.tic();
+
+		mForest.build(&mCenters.front(), K, M, mParams.trees, mix(mParams.seed + iter + 1));
+
+		// approximate assignment. A descriptor keeps its center when the
+		// forest doesn't find a closer one, so the energy can't grow
+		size_t changed = 0;
+		boost::mutex mutex;
+		parallelFor(pool, 0, N, 1024, [&](size_t b, size_t e)
+		{
+			float x[MAX_DIMS];
+			size_t local = 0;
+			for (size_t i = b; i < e; ++i)
+			{
+				std::copy(&data[i * M], &data[i * M] + M, x);
+
+				float d = 0;
+				uint32_t c = mForest.query(x, mParams.checks, &d);
+				if (ids[i] != (uint32_t)-1 && ids[i] != c)
+				{
+					float const * p = &mCenters[(size_t)ids[i] * M];
+					float dold = 0;
+					for (int j = 0; j < M; ++j)
+						dold += (x[j] - p[j]) * (x[j] - p[j]);
+					if (dold <= d)
+						c = ids[i];
+				}
+				if (c != ids[i])
+				{
+					ids[i] = c;
+					++local;
+				}
+			}
+			boost::lock_guard<boost::mutex> lock(mutex);
+			changed += local;
+		});
+
+		// group the descriptors by center and move the centers to the means
+		std::fill(offs.begin(), offs.end(), 0);
+		for (size_t i = 0; i < N; ++i)
+			++offs[ids[i] + 1];
+		for (size_t k = 0; k < K; ++k)
+			offs[k + 1] += offs[k];
+		{
+			std::vector<size_t> pos(offs.begin(), offs.end() - 1);
+			for (size_t i = 0; i < N; ++i)
+				order[pos[ids[i]]++] = i;
+		}
+
+		parallelFor(pool, 0, K, 256, [&](size_t b, size_t e)
+		{
+			std::vector<double> sum(M);
+			for (size_t k = b; k < e; ++k)
+			{
+				size_t n = offs[k + 1] - offs[k];
+				if (!n)
+					continue;
+
+				std::fill(sum.begin(), sum.end(), 0.0);
+				for (size_t o = offs[k]; o < offs[k + 1]; ++o)
+					for (int j = 0; j < M; ++j)
+						sum[j] += data[(size_t)order[o] * M + j];
+				for (int j = 0; j < M; ++j)
+					mCenters[k * M + j] = (float)(sum[j] / n);
+			}
+		});
+
+		std::cerr << "akm iteration " << iter << ": " << changed << " reassigned, "
+			<< timer.toc() << '\n';
+
+		if (changed == 0)
+			break;
+	}
+
+	index();
+}
+
+void AKMVocab::push(SiftDescr const * data, Word & word) const
+{
+	word = (Word)nearest(data, mParams.checks) + 1;
+}
+
+void AKMVocab::save(std::string const & fname) const
+{
+	std::ofstream of;
+	of.open(fname.c_str(), std::ofstream::binary);
+	save(of);
+	of.close();
+}
+
+void AKMVocab::save(std::ostream& os) const
+{
+	os << *this;
+}
+
+void AKMVocab::load(std::string const & fname)
+{
+	std::ifstream ifs;
+	ifs.open(fname.c_str(), std::ifstream::binary);
+	load(ifs);
+	ifs.close();
+}
+
+void AKMVocab::load(std::istream& is)
+{
+	is >> *this;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+std::ostream& operator<<(std::ostream& os, AKMVocab const& vocab)
+{
+	os.write(AKMVocab::MAGIC, sizeof(AKMVocab::MAGIC));
+	WRITE(vocab.mParams.dims);
+	WRITE(vocab.mParams.iters);
+	WRITE(vocab.mParams.trees);
+	WRITE(vocab.mParams.checks);
+	WRITE(vocab.mParams.seed);
+	WRITE(vocab.mWords);
+	if (vocab.mWords == 0)
+		throw std::runtime_error("AKMVocab is not trained. Cannot save it");
+
+	os.write(reinterpret_cast<char const *>(&vocab.mCenters.front()),
+		sizeof(vocab.mCenters[0]) * vocab.mCenters.size());
+	return os;
+}
+
+std::istream& operator>>(std::istream& is, AKMVocab & vocab)
+{
+	char magic[sizeof(AKMVocab::MAGIC)];
+	is.read(magic, sizeof(magic));
+	if (!is || memcmp(magic, AKMVocab::MAGIC, sizeof(magic)))
+		throw std::runtime_error("Not an AKM vocabulary");
+
+	READ(vocab.mParams.dims);
+	READ(vocab.mParams.iters);
+	READ(vocab.mParams.trees);
+	READ(vocab.mParams.checks);
+	READ(vocab.mParams.seed);
+	READ(vocab.mWords);
+	if (!is || vocab.mParams.dims <= 0 || vocab.mParams.dims > MAX_DIMS)
+		throw std::runtime_error("Broken AKM vocabulary");
+
+	vocab.mParams.words = vocab.mWords;
+	vocab.mCenters.resize((size_t)vocab.mWords * vocab.mParams.dims);
+	is.read(reinterpret_cast<char*>(&vocab.mCenters.front()),
+		sizeof(vocab.mCenters[0]) * vocab.mCenters.size());
+
+	vocab.index();
+	return is;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "KDForest.hpp"
+#include "Quantizer.hpp"
+#include "Util/types.hpp"
+
+// Flat vocabulary trained with approximate k-means: every iteration assigns
+// the descriptors to the nearest center found in a kd-forest over the
+// centers. Words are the centers 1..words.
+class AKMVocab : public Quantizer
+{
+public:
+
+	struct Params
+	{
+		Params(int dims = 128, int words = 100000, int iters = 10, int trees = 8, int checks = 64) :
+			dims(dims),
+			words(words),
+			iters(iters),
+			trees(trees),
+			checks(checks),
+			threads(1),
+			seed(0)
+		{
+		}
+
+		int dims;
+		int words;
+		int iters;
+		// kd-forest size and the number of centers compared per lookup
+		int trees;
+		int checks;
+
+		// training threads, 0 - one per core
+		unsigned threads;
+		unsigned seed;
+	};
+
+	AKMVocab(Params const & params);
+	AKMVocab(std::string const & fname);
+
+	void train(std::vector<SiftDescr> const & data);
+
+	using Quantizer::push;
+	void push(SiftDescr const * data, Word & word) const;
+
+	unsigned int maxWord() const { return mWords; }
+
+	int Dims() const { return mParams.dims; }
+	int Checks() const { return mParams.checks; }
+	void setChecks(int checks) { mParams.checks = checks; }
+
+	void save(std::string const & fname) const;
+	void save(std::ostream& os) const;
+
+	void load(std::string const & fname);
+	void load(std::istream& is);
+
+	// first bytes of the vocabulary files
+	static char const MAGIC[8];
+
+	friend std::ostream& operator<<(std::ostream& os, AKMVocab const& vocab);
+	friend std::istream& operator>>(std::istream& is, AKMVocab & vocab);
+
+private:
+
+	AKMVocab(AKMVocab const &);
+
+	size_t nearest(SiftDescr const * data, int checks) const;
+
+	void index();
+
+	Params mParams;
+
+	unsigned int mWords;
+	std::vector<float> mCenters;
+
+	KDForest mForest;
+};
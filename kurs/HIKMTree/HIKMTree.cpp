@@ -1,29 +1,48 @@
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <exception>
 #include <stdexcept>
 #include <fstream>
+#include <sstream>
+
+#include <boost/filesystem.hpp>
 
 #include "HIKMTree.hpp"
+#include "HamerlyKMeans.hpp"
+#include "Util/threads.hpp"
 #include "Util/util.hpp"
-#include "Image/Image.hpp"
 
-HIKMTree::HIKMTree(int dims, int clusters, int leaves, VlIKMAlgorithms method):
+namespace bfs = boost::filesystem;
+
+HIKMTree::HIKMTree(int dims, int clusters, int leaves, Method method):
 	mTree(nullptr),
-	mLeaves(leaves)
+	mLeaves(leaves),
+	mParams(dims, clusters, leaves, method),
+	mTrainLog(nullptr),
+	mWords(0),
+	mPrune(true)
 {
 	Init(dims, clusters, method);
 }
 
 HIKMTree::HIKMTree(HIKMTree::Params& params):
 	mTree(nullptr),
-	mLeaves(params.leaves)
+	mLeaves(params.leaves),
+	mParams(params),
+	mTrainLog(nullptr),
+	mWords(0),
+	mPrune(true)
 {
 	Init(params.dims, params.clusters, params.method);
 }
 
 HIKMTree::HIKMTree(std::string const &fname) :
 	mTree(nullptr),
-	mLeaves(0)
+	mLeaves(0),
+	mTrainLog(nullptr),
+	mWords(0),
+	mPrune(true)
 {
 	load(fname);
 }
@@ -33,9 +52,9 @@ HIKMTree::~HIKMTree(void)
 	vl_hikm_delete(mTree);
 }
 
-void HIKMTree::Init(int dims, int clusters, VlIKMAlgorithms method)
+void HIKMTree::Init(int dims, int clusters, Method method)
 {
-	mTree = vl_hikm_new(method);
+	mTree = vl_hikm_new(method == METHOD_HAMERLY ? VL_IKM_LLOYD : (VlIKMAlgorithms)method);
 	if (!mTree)
 		throw std::bad_alloc();
 
@@ -44,15 +63,1051 @@ void HIKMTree::Init(int dims, int clusters, VlIKMAlgorithms method)
 	vl_hikm_init(mTree, dims, clusters, depth);
 }
 
+//////////////////////////////////////////////////////////////////////////
+// Training. It follows vl_hikm_train: every node runs integer k-means on its
+// descriptors and recurses into the partitions. The centers are seeded from
+// the node path instead of the global vlfeat generator, so subtrees can be
+// trained in any order and on any thread with the same result.
+// Given an initial tree, a node starts from the centers of the node at the
+// same place there and runs a few refinement iterations only.
+// With a Hamerly report the nodes run HamerlyKMeans instead of vl_ikm_train.
+
+namespace
+{
+	void deleteNode(VlHIKMNode* node)
+	{
+		if (!node)
+			return;
+		if (node->children)
+		{
+			for (int k = 0; k < vl_ikm_get_K(node->filter); ++k)
+				deleteNode(node->children[k]);
+			vl_free(node->children);
+		}
+		vl_ikm_delete(node->filter);
+		vl_free(node);
+	}
+
+	// seeds the filter with K distinct descriptors drawn at random
+	void initCenters(VlIKMFilt* filter, SiftDescr const * data, size_t N, int M, int K, uint64_t seed)
+	{
+		// draw distinct descriptors in a random order (partial Fisher-Yates)
+		std::vector<uint32_t> perm(N);
+		for (size_t i = 0; i < N; ++i)
+			perm[i] = i;
+
+		std::vector<vl_ikm_acc> centers(M * K);
+		std::vector<uint32_t> picked;
+		uint64_t state = seed;
+		for (size_t i = 0; i < N && (int)picked.size() < K; ++i)
+		{
+			state = mix(state);
+			std::swap(perm[i], perm[i + state % (N - i)]);
+
+			SiftDescr const * x = data + (size_t)perm[i] * M;
+			bool dupe = false;
+			for (size_t j = 0; j < picked.size() && !dupe; ++j)
+				dupe = 0 == memcmp(x, data + (size_t)picked[j] * M, M);
+			if (!dupe)
+				picked.push_back(perm[i]);
+		}
+		// not enough distinct descriptors, repeat some
+		for (size_t i = 0; (int)picked.size() < K; ++i)
+			picked.push_back(perm[i]);
+
+		for (int k = 0; k < K; ++k)
+			std::copy(data + (size_t)picked[k] * M, data + (size_t)picked[k] * M + M, &centers[k * M]);
+
+		vl_ikm_init(filter, &centers.front(), M, K);
+	}
+
+	// runs the k-means of a node from its initial centers. Returns the
+	// iterations made, -1 when vlfeat doesn't tell
+	int trainFilter(VlIKMFilt* filter, SiftDescr const * data, size_t N, 
+		ThreadPool& pool, HamerlyKMeans::Report* hamerly)
+	{
+		if (!hamerly)
+		{
+			vl_ikm_train(filter, data, (int)N);
+			return -1;
+		}
+
+		HamerlyKMeans kmeans(pool, filter->M, filter->K);
+		int iters = kmeans.train(data, N, filter->centers, filter->max_niters);
+		hamerly->add(kmeans.stats());
+		return iters;
+	}
+
+	// cluster sizes and the sum of squared distances to the centers
+	struct NodeStats
+	{
+		NodeStats() :
+			energy(0)
+		{
+		}
+
+		void add(VlIKMFilt* filter, SiftDescr const * data, vl_uint const * ids, size_t n, ThreadPool& pool)
+		{
+			int M = filter->M;
+			int K = filter->K;
+			sizes.resize(K, 0);
+
+			std::vector<vl_uint> own;
+			if (!ids)
+			{
+				own.resize(n);
+				parallelFor(pool, 0, n, 4096, [&](size_t b, size_t e)
+				{
+					vl_ikm_push(filter, &own[b], data + b * M, (int)(e - b));
+				});
+				ids = n ? &own.front() : nullptr;
+			}
+
+			boost::mutex mutex;
+			parallelFor(pool, 0, n, 4096, [&](size_t b, size_t e)
+			{
+				uint64_t local = 0;
+				for (size_t i = b; i < e; ++i)
+				{
+					vl_ikm_acc const * c = filter->centers + ids[i] * M;
+					for (int j = 0; j < M; ++j)
+						local += (uint64_t)((data[i * M + j] - c[j]) * (data[i * M + j] - c[j]));
+				}
+				boost::lock_guard<boost::mutex> lock(mutex);
+				energy += local;
+			});
+
+			for (size_t i = 0; i < n; ++i)
+				++sizes[ids[i]];
+		}
+
+		uint64_t energy;
+		std::vector<size_t> sizes;
+	};
+
+	// Collects the per-node training records. The records go to a stream
+	// as JSON lines when there is one, the per-level wall time is summed up
+	// anyway.
+	class TrainLog
+	{
+	public:
+		explicit TrainLog(std::ostream* os) :
+			mOs(os)
+		{
+			mTimer.tic();
+		}
+
+		// whether the records are written and the node statistics needed
+		bool detailed() const { return mOs != nullptr; }
+
+		// seconds since the training start
+		double now() const { return mTimer.toc(); }
+
+		// path - comma separated center indices from the root
+		void node(int depth, std::string const & path, size_t N, int K, int iters, int maxIters, 
+			double begin, double end, NodeStats const & stats)
+		{
+			boost::lock_guard<boost::mutex> lock(mMutex);
+
+			if (mLevels.size() <= (size_t)depth)
+				mLevels.resize(depth + 1);
+			Level & l = mLevels[depth];
+			l.begin = l.nodes ? std::min(l.begin, begin) : begin;
+			l.end = l.nodes ? std::max(l.end, end) : end;
+			l.busy += end - begin;
+			l.descriptors += N;
+			++l.nodes;
+
+			if (!mOs)
+				return;
+
+			std::ostream & os = *mOs;
+			os << "{\"depth\":" << depth << ",\"path\":[" << path << "],\"descriptors\":" << N 
+				<< ",\"k\":" << K << ",\"iters\":";
+			if (iters < 0)
+				os << "null";
+			else
+				os << iters;
+			os << ",\"max_iters\":" << maxIters << ",\"time\":" << end - begin 
+				<< ",\"energy\":" << stats.energy << ",\"sizes\":[";
+			for (size_t k = 0; k < stats.sizes.size(); ++k)
+				os << (k ? "," : "") << stats.sizes[k];
+			os << "]}\n";
+		}
+
+		// per-level wall time and the peak memory, also as records
+		void summary(std::ostream & text) const
+		{
+			boost::lock_guard<boost::mutex> lock(mMutex);
+
+			double total = now();
+			size_t peak = peakMemory();
+			for (size_t d = 0; d < mLevels.size(); ++d)
+			{
+				Level const & l = mLevels[d];
+				text << "level " << d << ": " << l.nodes << " nodes, " << l.descriptors << " descriptors, "
+					<< l.end - l.begin << " s wall, " << l.busy << " s in nodes\n";
+				if (mOs)
+					*mOs << "{\"level\":" << d << ",\"nodes\":" << l.nodes << ",\"descriptors\":" << l.descriptors
+						<< ",\"wall\":" << l.end - l.begin << ",\"busy\":" << l.busy << "}\n";
+			}
+			text << "training: " << total << " s, peak memory " << peak / (1 << 20) << " MiB\n";
+			if (mOs)
+				*mOs << "{\"total\":" << total << ",\"peak_memory\":" << peak << "}\n";
+		}
+
+	private:
+		struct Level
+		{
+			Level() :
+				nodes(0),
+				descriptors(0),
+				begin(0),
+				end(0),
+				busy(0)
+			{
+			}
+
+			size_t nodes;
+			size_t descriptors;
+			double begin;
+			double end;
+			double busy;
+		};
+
+		std::ostream* mOs;
+		mutable Timer mTimer;
+		mutable boost::mutex mMutex;
+		std::vector<Level> mLevels;
+	};
+
+	std::string childPath(std::string const & path, int k)
+	{
+		std::ostringstream os;
+		os << path << (path.empty() ? "" : ",") << k;
+		return os.str();
+	}
+
+	VlHIKMNode* newNode(VlHIKMTree const & tree)
+	{
+		VlHIKMNode* node = static_cast<VlHIKMNode*>(vl_malloc(sizeof(VlHIKMNode)));
+		node->filter = vl_ikm_new(tree.method);
+		node->children = nullptr;
+		vl_ikm_set_max_niters(node->filter, tree.max_niters);
+		vl_ikm_set_verbosity(node->filter, tree.verb - 1);
+		return node;
+	}
+
+	class Trainer
+	{
+	public:
+		// trains height levels of the tree on count descriptors. Warm
+		// started nodes run at most refine iterations. The nodes reorder
+		// the descriptors in place, each node only its own slice of them
+		Trainer(VlHIKMTree const & tree, ThreadPool& pool, 
+			SiftDescr* data, size_t count, int height, int refine = 0, 
+			HamerlyKMeans::Report* hamerly = nullptr, TrainLog* log = nullptr) :
+			mTree(tree),
+			mHeight(height),
+			mData(data),
+			mCount(count),
+			mRefine(refine),
+			mHamerly(hamerly),
+			mLog(log),
+			mPool(pool)
+		{
+		}
+
+		// path - of the subtree root in the whole tree, for the log
+		VlHIKMNode* train(uint64_t seed, VlHIKMNode const * init = nullptr, std::string const & path = std::string())
+		{
+			return node(0, 0, mCount, (int)VL_MIN((size_t)mTree.K, mCount), seed, init, init, path);
+		}
+
+	private:
+
+		// init - node whose centers this one starts from, shape - node of
+		// the initial tree at this place, the subtree ends at its leaves
+		VlHIKMNode* node(int depth, size_t first, size_t N, int K, uint64_t seed, 
+			VlHIKMNode const * init, VlHIKMNode const * shape, std::string const & path)
+		{
+			int M = mTree.M;
+			int height = mHeight - depth;
+			SiftDescr* data = mData + first * M;
+			double begin = mLog ? mLog->now() : 0;
+			int iters = -1;
+
+			VlHIKMNode* node = newNode(mTree);
+
+			if (N == 0)
+			{
+				// nothing gets here, keep it as a leaf without centers
+				vl_ikm_init(node->filter, nullptr, M, 0);
+				return node;
+			}
+
+			bool warm = init && init->filter->K > 0 && (size_t)init->filter->K <= N;
+			if (warm)
+			{
+				K = init->filter->K;
+				vl_ikm_init(node->filter, init->filter->centers, M, K);
+				vl_ikm_set_max_niters(node->filter, mRefine);
+				iters = trainFilter(node->filter, data, N, mPool, mHamerly);
+				vl_ikm_set_max_niters(node->filter, mTree.max_niters);
+			}
+			else
+			{
+				// the initial tree has no usable centers here
+				initCenters(node->filter, data, N, M, K, seed);
+				iters = trainFilter(node->filter, data, N, mPool, mHamerly);
+			}
+
+			// split trees have leaves above the full depth, keep them
+			if (height == 1 || (shape && !shape->children))
+			{
+				if (mLog)
+					log(node->filter, depth, path, data, N, iters, warm ? mRefine : mTree.max_niters, begin, nullptr);
+				return node;
+			}
+
+			// assign the descriptors to the centers
+			std::vector<vl_uint> ids(N);
+			VlIKMFilt* filter = node->filter;
+			parallelFor(mPool, 0, N, 4096, [&](size_t b, size_t e)
+			{
+				vl_ikm_push(filter, &ids[b], data + b * M, (int)(e - b));
+			});
+
+			// logged while the ids still match the descriptors
+			if (mLog)
+				log(filter, depth, path, data, N, iters, warm ? mRefine : mTree.max_niters, begin, &ids.front());
+
+			// stable counting sort of the descriptors by center, the
+			// permutation is applied in place by following its cycles
+			std::vector<size_t> offs(K + 1, 0);
+			for (size_t i = 0; i < N; ++i)
+				++offs[ids[i] + 1];
+			for (int k = 0; k < K; ++k)
+				offs[k + 1] += offs[k];
+
+			std::vector<size_t> dest(N);
+			{
+				std::vector<size_t> pos(offs.begin(), offs.end() - 1);
+				for (size_t i = 0; i < N; ++i)
+					dest[i] = pos[ids[i]]++;
+			}
+			std::vector<vl_uint>().swap(ids);
+			for (size_t i = 0; i < N; ++i)
+				while (dest[i] != i)
+				{
+					size_t j = dest[i];
+					std::swap_ranges(data + i * M, data + (i + 1) * M, data + j * M);
+					std::swap(dest[i], dest[j]);
+				}
+			std::vector<size_t>().swap(dest);
+
+			node->children = static_cast<VlHIKMNode**>(vl_malloc(sizeof(*node->children) * K));
+			std::fill(node->children, node->children + K, (VlHIKMNode*)nullptr);
+
+			TaskGroup group(mPool);
+			for (int k = 0; k < K; ++k)
+			{
+				size_t cfirst = first + offs[k];
+				size_t cN = offs[k + 1] - offs[k];
+				int cK = (int)VL_MIN((size_t)mTree.K, cN);
+				uint64_t cseed = mix(seed ^ (k + 1));
+				VlHIKMNode const * cinit = warm && init->children ? init->children[k] : nullptr;
+				VlHIKMNode const * cshape = shape && k < shape->filter->K ? shape->children[k] : nullptr;
+				VlHIKMNode** slot = &node->children[k];
+				std::string cpath = childPath(path, k);
+				group.run([=]()
+				{
+					*slot = this->node(depth + 1, cfirst, cN, cK, cseed, cinit, cshape, cpath);
+				});
+			}
+			try
+			{
+				group.wait();
+			}
+			catch (...)
+			{
+				deleteNode(node);
+				throw;
+			}
+
+			return node;
+		}
+
+		void log(VlIKMFilt* filter, int depth, std::string const & path, SiftDescr const * data, size_t N, 
+			int iters, int maxIters, double begin, vl_uint const * ids)
+		{
+			double end = mLog->now();
+			NodeStats stats;
+			if (mLog->detailed())
+				stats.add(filter, data, ids, N, mPool);
+			mLog->node(mTree.depth - mHeight + depth, path, N, filter->K, iters, maxIters, begin, end, stats);
+		}
+
+		VlHIKMTree const & mTree;
+		int mHeight;
+		SiftDescr* mData;
+		size_t mCount;
+		int mRefine;
+		HamerlyKMeans::Report* mHamerly;
+		TrainLog* mLog;
+		ThreadPool& mPool;
+	};
+
+	// Trains the upper levels of the tree over a raw descriptor file that
+	// doesn't fit in memory. Such a node runs Lloyd iterations as passes over
+	// the file and writes the partitions of its children to temporary files.
+	// Nodes of at most memCount descriptors are loaded and given to Trainer,
+	// which partitions them where they were loaded.
+	class FileTrainer
+	{
+	public:
+		FileTrainer(VlHIKMTree const & tree, ThreadPool& pool, 
+			std::string const & tmpDir, size_t memCount, HamerlyKMeans::Report* hamerly = nullptr, 
+			TrainLog* log = nullptr) :
+			mTree(tree),
+			mPool(pool),
+			mHamerly(hamerly),
+			mLog(log),
+			mTmpDir(tmpDir),
+			mMemCount(memCount),
+			mChunk(VL_MIN(memCount, (size_t)1 << 16))
+		{
+		}
+
+		// temp - fname is a partition file to remove once it was read
+		VlHIKMNode* node(std::string const & fname, bool temp, int depth, size_t N, int K, uint64_t seed, 
+			std::string const & path = std::string())
+		{
+			int M = mTree.M;
+			int height = mTree.depth - depth;
+
+			if (N <= mMemCount)
+			{
+				std::vector<SiftDescr> data(N * M);
+				if (N)
+					read(fname, 0, N, &data.front());
+				if (temp)
+					bfs::remove(fname);
+
+				Trainer trainer(mTree, mPool, N ? &data.front() : nullptr, N, height, 0, mHamerly, mLog);
+				return trainer.train(seed, nullptr, path);
+			}
+
+			VlHIKMNode* node = newNode(mTree);
+			try
+			{
+				double begin = mLog ? mLog->now() : 0;
+
+				std::cerr << "out-of-core node: depth " << depth << ", " << N << " descriptors" << '\n';
+
+				// centers are seeded from a reservoir sample of the node
+				std::vector<SiftDescr> sample;
+				reservoir(fname, N, mMemCount, seed, sample);
+				initCenters(node->filter, &sample.front(), sample.size() / M, M, K, seed);
+				sample.clear();
+
+				int iters = lloyd(fname, N, node->filter);
+
+				// logged before partition, which trains the children
+				if (mLog)
+				{
+					double end = mLog->now();
+					NodeStats stats;
+					if (mLog->detailed())
+					{
+						std::vector<vl_uint> ids;
+						stream(fname, N, [&](SiftDescr const * data, size_t n)
+						{
+							assign(node->filter, data, n, ids);
+							stats.add(node->filter, data, &ids.front(), n, mPool);
+						});
+					}
+					mLog->node(depth, path, N, K, iters, mTree.max_niters, begin, end, stats);
+				}
+
+				if (height > 1)
+					partition(fname, N, node, depth, seed, path);
+			}
+			catch (...)
+			{
+				deleteNode(node);
+				throw;
+			}
+			if (temp)
+				bfs::remove(fname);
+
+			return node;
+		}
+
+	private:
+
+		void read(std::string const & fname, size_t first, size_t count, SiftDescr* data) const
+		{
+			std::ifstream is(fname.c_str(), std::ifstream::binary);
+			is.seekg(first * mTree.M);
+			is.read(reinterpret_cast<char*>(data), count * mTree.M);
+			if (!is)
+				throw std::runtime_error("Cannot read descriptors from " + fname);
+		}
+
+		// calls fn(chunk, count) for consecutive chunks of the file
+		template<typename Fn>
+		void stream(std::string const & fname, size_t N, Fn fn) const
+		{
+			std::ifstream is(fname.c_str(), std::ifstream::binary);
+			std::vector<SiftDescr> buf(mChunk * mTree.M);
+			for (size_t done = 0; done < N; )
+			{
+				size_t n = VL_MIN(mChunk, N - done);
+				is.read(reinterpret_cast<char*>(&buf.front()), n * mTree.M);
+				if (!is)
+					throw std::runtime_error("Cannot read descriptors from " + fname);
+				fn(&buf.front(), n);
+				done += n;
+			}
+		}
+
+		void reservoir(std::string const & fname, size_t N, size_t size, uint64_t seed, std::vector<SiftDescr>& sample) const
+		{
+			int M = mTree.M;
+			size = VL_MIN(size, N);
+			sample.resize(size * M);
+
+			uint64_t state = ~seed;
+			size_t seen = 0;
+			stream(fname, N, [&](SiftDescr const * data, size_t n)
+			{
+				for (size_t i = 0; i < n; ++i, ++seen)
+				{
+					state = mix(state);
+					size_t slot = seen < size ? seen : state % (seen + 1);
+					if (slot < size)
+						memcpy(&sample[slot * M], data + i * M, M);
+				}
+			});
+		}
+
+		void assign(VlIKMFilt* filter, SiftDescr const * data, size_t n, std::vector<vl_uint>& ids) const
+		{
+			int M = mTree.M;
+			ids.resize(n);
+			parallelFor(mPool, 0, n, 4096, [&](size_t b, size_t e)
+			{
+				vl_ikm_push(filter, &ids[b], data + b * M, (int)(e - b));
+			});
+		}
+
+		// Lloyd iterations, each one is a pass over the file. Integer sums
+		// make the result independent of the chunking and threads.
+		int lloyd(std::string const & fname, size_t N, VlIKMFilt* filter) const
+		{
+			int M = mTree.M;
+			int K = vl_ikm_get_K(filter);
+			std::vector<vl_ikm_acc> centers(filter->centers, filter->centers + M * K);
+			std::vector<vl_uint> ids;
+
+			int iter = 0;
+			for (; iter < mTree.max_niters; ++iter)
+			{
+				std::vector<int64_t> sums(M * K, 0);
+				std::vector<int64_t> counts(K, 0);
+				boost::mutex mutex;
+
+				stream(fname, N, [&](SiftDescr const * data, size_t n)
+				{
+					assign(filter, data, n, ids);
+					parallelFor(mPool, 0, n, 4096, [&](size_t b, size_t e)
+					{
+						std::vector<int64_t> s(M * K, 0);
+						std::vector<int64_t> c(K, 0);
+						for (size_t i = b; i < e; ++i)
+						{
+							vl_uint k = ids[i];
+							++c[k];
+							for (int j = 0; j < M; ++j)
+								s[k * M + j] += data[i * M + j];
+						}
+
+						boost::lock_guard<boost::mutex> lock(mutex);
+						for (int j = 0; j < M * K; ++j)
+							sums[j] += s[j];
+						for (int k = 0; k < K; ++k)
+							counts[k] += c[k];
+					});
+				});
+
+				// empty clusters keep their centers
+				std::vector<vl_ikm_acc> next(centers);
+				for (int k = 0; k < K; ++k)
+					if (counts[k])
+						for (int j = 0; j < M; ++j)
+							next[k * M + j] = (vl_ikm_acc)(sums[k * M + j] / counts[k]);
+
+				if (next == centers)
+					break;
+				centers.swap(next);
+				vl_ikm_init(filter, &centers.front(), M, K);
+			}
+
+			if (filter->method == VL_IKM_ELKAN)
+			{
+				// the inter-center distances vlfeat keeps for elkan filters
+				if (!filter->inter_dist)
+					filter->inter_dist = static_cast<vl_ikm_acc*>(vl_malloc(sizeof(vl_ikm_acc) * K * K));
+				for (int k = 0; k < K; ++k)
+					for (int l = 0; l < K; ++l)
+					{
+						vl_ikm_acc d = 0;
+						for (int j = 0; j < M; ++j)
+						{
+							vl_ikm_acc t = centers[k * M + j] - centers[l * M + j];
+							d += t * t;
+						}
+						filter->inter_dist[k * K + l] = d >> 2;
+					}
+			}
+
+			std::cerr << "out-of-core node: " << iter << " passes" << '\n';
+			return iter;
+		}
+
+		void partition(std::string const & fname, size_t N, VlHIKMNode* node, int depth, uint64_t seed, 
+			std::string const & path)
+		{
+			int M = mTree.M;
+			int K = vl_ikm_get_K(node->filter);
+
+			std::vector<std::string> names(K);
+			std::vector<size_t> counts(K, 0);
+			{
+				std::vector<std::ofstream*> files(K);
+				try
+				{
+					for (int k = 0; k < K; ++k)
+					{
+						std::ostringstream name;
+						name << std::hex << seed << '-' << k << ".descr";
+						names[k] = (bfs::path(mTmpDir) / name.str()).string();
+						files[k] = new std::ofstream(names[k].c_str(), std::ofstream::binary);
+						if (!*files[k])
+							throw std::runtime_error("Cannot create " + names[k]);
+					}
+
+					std::vector<vl_uint> ids;
+					stream(fname, N, [&](SiftDescr const * data, size_t n)
+					{
+						assign(node->filter, data, n, ids);
+						for (size_t i = 0; i < n; ++i)
+						{
+							files[ids[i]]->write(reinterpret_cast<char const*>(data + i * M), M);
+							++counts[ids[i]];
+						}
+					});
+
+					for (int k = 0; k < K; ++k)
+					{
+						files[k]->close();
+						if (!*files[k])
+							throw std::runtime_error("Cannot write " + names[k]);
+					}
+				}
+				catch (...)
+				{
+					for (int k = 0; k < K; ++k)
+						delete files[k];
+					throw;
+				}
+				for (int k = 0; k < K; ++k)
+					delete files[k];
+			}
+
+			// one child at a time, so only one node is in memory
+			node->children = static_cast<VlHIKMNode**>(vl_malloc(sizeof(*node->children) * K));
+			std::fill(node->children, node->children + K, (VlHIKMNode*)nullptr);
+			for (int k = 0; k < K; ++k)
+			{
+				int cK = (int)VL_MIN((size_t)mTree.K, counts[k]);
+				node->children[k] = this->node(names[k], true, depth + 1, counts[k], cK, mix(seed ^ (k + 1)), childPath(path, k));
+			}
+		}
+
+		VlHIKMTree const & mTree;
+		ThreadPool& mPool;
+		HamerlyKMeans::Report* mHamerly;
+		TrainLog* mLog;
+		std::string mTmpDir;
+		size_t mMemCount;
+		size_t mChunk;
+	};
+}
+
 void HIKMTree::train(std::vector<unsigned char> const & data)
 {
-	vl_hikm_train(mTree, &data.front(), data.size() / Dims());
+	TRACE;
+
+	trainFrom(data, nullptr, 0);
+}
+
+void HIKMTree::train(std::vector<unsigned char> const & data, HIKMTree const & init, int iters)
+{
+	TRACE;
+
+	if (init.Dims() != Dims())
+		throw std::runtime_error("The initial tree has other descriptor dimensions");
+	if (iters < 1)
+		throw std::logic_error("Refinement needs at least one iteration");
+
+	// the shape comes from the initial tree
+	mTree->K = init.mTree->K;
+	mTree->depth = init.mTree->depth;
+	mLeaves = init.mLeaves;
+
+	trainFrom(data, init.mTree->root, iters);
+}
+
+void HIKMTree::trainFrom(std::vector<unsigned char> const & data, VlHIKMNode const * init, int iters)
+{
+	size_t count = data.size() / Dims();
+	if (count == 0)
+		throw std::runtime_error("No descriptors to train the tree on");
+
+	deleteNode(mTree->root);
+	mTree->root = nullptr;
+
+	ThreadPool pool(mParams.threads);
+	HamerlyKMeans::Report report;
+	bool hamerly = mParams.method == METHOD_HAMERLY;
+	TrainLog log(mTrainLog);
+	// the trainer reorders the descriptors
+	std::vector<SiftDescr> work(data);
+	Trainer trainer(*mTree, pool, &work.front(), count, Depth(), iters, hamerly ? &report : nullptr, &log);
+	mTree->root = trainer.train(mix(mParams.seed), init);
+	index();
+
+	if (hamerly)
+		report.print(std::cerr);
+	log.summary(std::cerr);
+}
+
+void HIKMTree::train(std::string const & fname, std::string const & tmpDir, size_t memCount)
+{
+	TRACE;
+
+	size_t count = bfs::file_size(fname) / Dims();
+	if (count == 0)
+		throw std::runtime_error("No descriptors to train the tree on");
+
+	deleteNode(mTree->root);
+	mTree->root = nullptr;
+
+	ThreadPool pool(mParams.threads);
+	HamerlyKMeans::Report report;
+	bool hamerly = mParams.method == METHOD_HAMERLY;
+	TrainLog log(mTrainLog);
+	// the partitions of this run, gone also when training fails
+	TempDir tmp(tmpDir);
+	FileTrainer trainer(*mTree, pool, tmp.path, VL_MAX(memCount, (size_t)1), hamerly ? &report : nullptr, &log);
+	mTree->root = trainer.node(fname, false, 0, count, (int)VL_MIN((size_t)Clusters(), count), mix(mParams.seed));
+	index();
+
+	if (hamerly)
+		report.print(std::cerr);
+	log.summary(std::cerr);
+}
+
+size_t HIKMTree::split(std::vector<SiftDescr> const & data, size_t maxPopulation, 
+	std::vector<size_t> const * docs, size_t maxDocs, int passes)
+{
+	TRACE;
+
+	int const M = Dims();
+	size_t const N = data.size() / M;
+	if (N == 0)
+		throw std::runtime_error("No descriptors to split the tree with");
+	if (!mTree || !mTree->root)
+		throw std::logic_error("HIKMTree is not trained");
+
+	ThreadPool pool(mParams.threads);
+	// the new nodes are trained like the rest of the tree
+	HamerlyKMeans::Report report;
+	bool hamerly = mParams.method == METHOD_HAMERLY;
+	size_t total = 0;
+	// single-center leaves of the centers whose descriptors couldn't be split
+	std::vector<VlHIKMNode const *> stuck;
+
+	for (int pass = 0; pass < passes; ++pass)
+	{
+		std::vector<Word> words(N);
+		parallelFor(pool, 0, N, 4096, [&](size_t b, size_t e)
+		{
+			for (size_t i = b; i < e; ++i)
+				push(&data[i * M], words[i]);
+		});
+
+		std::vector<size_t> population(mWords + 1, 0);
+		for (size_t i = 0; i < N; ++i)
+			++population[words[i]];
+
+		// the leaves in the order of index(), so word = firstWord + center
+		std::vector<VlHIKMNode*> leaves;
+		std::vector<unsigned int> firstWords;
+		{
+			std::vector<VlHIKMNode*> queue(1, mTree->root);
+			unsigned int word = 1;
+			for (size_t i = 0; i < queue.size(); ++i)
+			{
+				VlHIKMNode* node = queue[i];
+				if (node->children)
+				{
+					queue.insert(queue.end(), node->children, node->children + node->filter->K);
+					continue;
+				}
+				leaves.push_back(node);
+				firstWords.push_back(word);
+				word += VL_MAX(node->filter->K, 1);
+			}
+		}
+
+		std::vector<bool> over(mWords + 1, false);
+		size_t overCount = 0;
+		for (size_t l = 0; l < leaves.size(); ++l)
+		{
+			if (leaves[l]->filter->K == 0 || 
+				std::find(stuck.begin(), stuck.end(), leaves[l]) != stuck.end())
+				continue;
+			for (int c = 0; c < leaves[l]->filter->K; ++c)
+			{
+				unsigned int w = firstWords[l] + c;
+				// the document counts belong to the words of the tree as given
+				bool crowded = pass == 0 && docs && maxDocs && w - 1 < docs->size() && (*docs)[w - 1] > maxDocs;
+				if (population[w] > 1 && ((maxPopulation && population[w] > maxPopulation) || crowded))
+				{
+					over[w] = true;
+					++overCount;
+				}
+			}
+		}
+
+		size_t largest = *std::max_element(population.begin(), population.end());
+		std::cerr << "split pass " << pass << ": " << overCount << " centers over the limit, largest word " 
+			<< largest << " descriptors" << '\n';
+		if (!overCount)
+			break;
+
+		// the descriptors of the split words, grouped by word
+		std::vector<size_t> offs(mWords + 2, 0);
+		for (size_t i = 0; i < N; ++i)
+			if (over[words[i]])
+				++offs[words[i] + 1];
+		for (size_t w = 0; w <= mWords; ++w)
+			offs[w + 1] += offs[w];
+		std::vector<SiftDescr> grouped(offs.back() * M);
+		{
+			std::vector<size_t> pos(offs.begin(), offs.end() - 1);
+			for (size_t i = 0; i < N; ++i)
+				if (over[words[i]])
+					memcpy(&grouped[pos[words[i]]++ * M], &data[i * M], M);
+		}
+
+		for (size_t l = 0; l < leaves.size(); ++l)
+		{
+			VlHIKMNode* leaf = leaves[l];
+			int K = leaf->filter->K;
+
+			bool any = false;
+			for (int c = 0; c < K; ++c)
+				any = any || over[firstWords[l] + c];
+			if (!any)
+				continue;
+
+			leaf->children = static_cast<VlHIKMNode**>(vl_malloc(sizeof(*leaf->children) * K));
+			for (int c = 0; c < K; ++c)
+			{
+				unsigned int w = firstWords[l] + c;
+				VlHIKMNode* child = nullptr;
+
+				if (over[w])
+				{
+					size_t n = offs[w + 1] - offs[w];
+					SiftDescr* sub = &grouped[offs[w] * M];
+					Trainer trainer(*mTree, pool, sub, n, 1, 0, hamerly ? &report : nullptr);
+					child = trainer.train(mix(mix(mParams.seed) + pass * 0x10001ULL + w));
+
+					// identical descriptors all stay with one center
+					std::vector<vl_uint> ids(n);
+					vl_ikm_push(child->filter, &ids.front(), sub, (int)n);
+					if (std::count(ids.begin(), ids.end(), ids[0]) == (std::ptrdiff_t)n)
+					{
+						deleteNode(child);
+						child = nullptr;
+					}
+					else
+					{
+						++total;
+					}
+				}
+
+				if (!child)
+				{
+					child = newNode(*mTree);
+					vl_ikm_init(child->filter, leaf->filter->centers + c * M, M, 1);
+					if (over[w])
+						stuck.push_back(child);
+				}
+				leaf->children[c] = child;
+			}
+		}
+
+		// the deepest leaf sets the path length
+		int depth = 0;
+		{
+			std::vector<std::pair<VlHIKMNode const *, int> > queue(1, std::make_pair((VlHIKMNode const *)mTree->root, 1));
+			for (size_t i = 0; i < queue.size(); ++i)
+			{
+				VlHIKMNode const * node = queue[i].first;
+				depth = VL_MAX(depth, queue[i].second);
+				if (node->children)
+					for (int k = 0; k < node->filter->K; ++k)
+						queue.push_back(std::make_pair((VlHIKMNode const *)node->children[k], queue[i].second + 1));
+			}
+		}
+		mTree->depth = depth;
+
+		index();
+	}
+
+	if (hamerly && total)
+		report.print(std::cerr);
+	return total;
+}
+
+void HIKMTree::index()
+{
+	mNodes.clear();
+	mCenters.clear();
+	mInterDist.clear();
+	mWords = 0;
+	if (!mTree || !mTree->root)
+		return;
+
+	std::vector<VlHIKMNode const *> queue(1, mTree->root);
+	for (size_t i = 0; i < queue.size(); ++i)
+	{
+		VlHIKMNode const * node = queue[i];
+		WordNode n = { node->filter, 0, 0, mCenters.size(), mInterDist.size() };
+
+		// the saved inter_dist is quarter distances of elkan filters only,
+		// the exact ones are cheap to recompute
+		int M = node->filter->M;
+		int K = node->filter->K;
+		vl_ikm_acc const * c = node->filter->centers;
+		for (int j = 0; j < M * K; ++j)
+			mCenters.push_back((int16_t)c[j]);
+		for (int a = 0; a < K; ++a)
+			for (int b = 0; b < K; ++b)
+			{
+				uint32_t d = 0;
+				for (int j = 0; j < M; ++j)
+					d += (c[a * M + j] - c[b * M + j]) * (c[a * M + j] - c[b * M + j]);
+				mInterDist.push_back(d);
+			}
+		if (node->children)
+		{
+			n.children = queue.size();
+			queue.insert(queue.end(), node->children, node->children + node->filter->K);
+		}
+		else
+		{
+			// an empty leaf has no centers, it gets the word of its parent center
+			n.firstWord = mWords + 1;
+			mWords += VL_MAX(node->filter->K, 1);
+		}
+		mNodes.push_back(n);
+	}
+}
+
+unsigned int HIKMTree::descend(SiftDescr const * data, unsigned int * path, PushStats* stats) const
+{
+	if (mNodes.empty())
+		throw std::logic_error("HIKMTree is not trained");
+
+	int const M = Dims();
+	size_t computed = 0;
+	size_t skipped = 0;
+
+	// an empty leaf keeps the word of its parent center
+	unsigned int word = 0;
+	WordNode const * node = &mNodes.front();
+	while (!word)
+	{
+		int K = node->filter->K;
+		if (K == 0)
+		{
+			word = node->firstWord;
+			break;
+		}
+		if (K == 1)
+		{
+			// single-center node of a split leaf
+			if (path)
+				*path++ = 0;
+			if (node->children)
+				node = &mNodes[node->children];
+			else
+				word = node->firstWord;
+			continue;
+		}
+
+		// nearest center, ties go to the smaller index as in vl_ikm_push.
+		// A center c with |c - best| >= 2 |x - best| can't be closer than
+		// best, so it is skipped
+		int16_t const * centers = &mCenters[node->centers];
+		uint32_t const * inter = mInterDist.empty() ? nullptr : &mInterDist[node->inter];
+		vl_uint best = 0;
+		uint32_t dbest = HamerlyKMeans::distance(data, centers, M);
+		++computed;
+		for (int k = 1; k < K; ++k)
+		{
+			if (mPrune && inter[best * K + k] >= 4 * (uint64_t)dbest)
+			{
+				++skipped;
+				continue;
+			}
+
+			uint32_t d = HamerlyKMeans::distance(data, centers + k * M, M);
+			++computed;
+			if (d < dbest)
+			{
+				dbest = d;
+				best = k;
+			}
+		}
+
+		if (path)
+			*path++ = best;
+		if (node->children)
+			node = &mNodes[node->children + best];
+		else
+			word = node->firstWord + best;
+	}
+
+	if (stats)
+	{
+		stats->computed += computed;
+		stats->skipped += skipped;
+	}
+	return word;
 }
 
 void HIKMTree::push(SiftDescr const * data, std::vector<unsigned int> & word) const
 {
-	word.resize(Depth() * 1);
-	vl_hikm_push(mTree, &word.front(), data, 1);
+	word.assign(Depth(), 0);
+	descend(data, &word.front(), nullptr);
 }
 
 void HIKMTree::push(std::vector<SiftDescr> const & data, std::vector<unsigned int> & word)
@@ -62,16 +1117,12 @@ void HIKMTree::push(std::vector<SiftDescr> const & data, std::vector<unsigned in
 
 void HIKMTree::push(SiftDescr const * data, unsigned int & word) const
 {
-	push(data, mWordBuf);
+	word = descend(data, nullptr, nullptr);
+}
 
-	word = 0;
-	unsigned int p = 1;
-	unsigned int k = Clusters();
-	for (auto it = mWordBuf.begin(); it != mWordBuf.end(); ++it)
-	{
-		word += (*it) * p;
-		p *= k;
-	}
+void HIKMTree::push(SiftDescr const * data, unsigned int & word, PushStats& stats) const
+{
+	word = descend(data, nullptr, &stats);
 }
 
 void HIKMTree::push(std::vector<SiftDescr> const & data, unsigned int & word)
@@ -79,25 +1130,45 @@ void HIKMTree::push(std::vector<SiftDescr> const & data, unsigned int & word)
 	push(&data.front(), word);
 }
 
-void HIKMTree::push(Image& img)
+unsigned int HIKMTree::maxWord() const
 {
-	TRACE;
-
-	auto & iwords = img.getWords();
-	auto    idscr = img.getDescr();
-	auto   nidscr = img.getDescrCount();
+	return mWords;
+}
 
-	iwords.clear();
-	iwords.resize(nidscr);
-	for (size_t i = 0; i < nidscr; ++i)
+namespace
+{
+	// leaf centers of a that differ from the ones at the same place in b
+	size_t movedWords(VlHIKMNode const * a, VlHIKMNode const * b)
 	{
-		push(&idscr[i * 128], iwords[i]);
+		int K = a->filter->K;
+		if (a->children)
+		{
+			size_t moved = 0;
+			for (int k = 0; k < K; ++k)
+			{
+				VlHIKMNode const * bk = b && b->children && k < b->filter->K ? b->children[k] : nullptr;
+				moved += movedWords(a->children[k], bk);
+			}
+			return moved;
+		}
+
+		if (!b || b->children || b->filter->K != K || b->filter->M != a->filter->M)
+			return VL_MAX(K, 1);
+
+		size_t moved = 0;
+		int M = a->filter->M;
+		for (int k = 0; k < K; ++k)
+			moved += 0 != memcmp(a->filter->centers + k * M, b->filter->centers + k * M, 
+				sizeof(a->filter->centers[0]) * M);
+		return moved;
 	}
 }
 
-unsigned int HIKMTree::maxWord() const
+size_t HIKMTree::movedWords(HIKMTree const & other) const
 {
-	return (unsigned int)pow((double)Clusters(), Depth()) - 1;
+	if (!mTree || !mTree->root)
+		return 0;
+	return ::movedWords(mTree->root, other.mTree ? other.mTree->root : nullptr);
 }
 
 void HIKMTree::save(std::string const & fname) const
@@ -269,6 +1340,7 @@ std::istream& operator>>(std::istream& is, HIKMTree & tree)
 	tree.mTree = vl_hikm_new(0);
 
 	is >> *tree.mTree;
+	tree.index();
 	return is;
 }
 
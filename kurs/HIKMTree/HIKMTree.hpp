@@ -5,52 +5,118 @@
 
 #include <istream>
 #include <ostream>
+#include <string>
 
+#include "Quantizer.hpp"
 #include "Util/types.hpp"
 
-class Image;
-
-class HIKMTree
+class HIKMTree : public Quantizer
 {
 public:
 
+	enum Method
+	{
+		METHOD_LLOYD = VL_IKM_LLOYD,
+		METHOD_ELKAN = VL_IKM_ELKAN,
+		// own k-means with Hamerly's bounds, the nodes are saved as lloyd
+		METHOD_HAMERLY
+	};
+
 	struct Params
 	{
-		Params(int dims = 128, int clusters = 3, int leaves = 100, VlIKMAlgorithms method = VL_IKM_ELKAN) :
+		Params(int dims = 128, int clusters = 3, int leaves = 100, Method method = METHOD_ELKAN) :
 			dims(dims),
 			clusters(clusters),
 			leaves(leaves),
-			method(method)
+			method(method),
+			threads(1),
+			seed(0)
 		{
 		}
 
 		int dims;
 		int clusters;
 		int leaves;
-		VlIKMAlgorithms method;
+		Method method;
+
+		// training threads, 0 - one per core. The tree doesn't depend on it
+		unsigned threads;
+		// seed of the centers initialization
+		unsigned seed;
+	};
+
+	// center distances of push calls
+	struct PushStats
+	{
+		PushStats() :
+			computed(0),
+			skipped(0)
+		{
+		}
+
+		size_t computed;
+		size_t skipped;
 	};
 
-	HIKMTree(int dims, int clusters, int leaves, VlIKMAlgorithms method = VL_IKM_ELKAN);
+	HIKMTree(int dims, int clusters, int leaves, Method method = METHOD_ELKAN);
 	HIKMTree(HIKMTree::Params& params);
 	HIKMTree(std::string const &fname);
 	~HIKMTree(void);
 
+	// trains the tree, sibling subtrees are trained concurrently when
+	// Params::threads != 1
 	void train(std::vector<unsigned char> const & data);
 
+	// retrains the tree in the shape of init starting every node from the
+	// centers init has at the same place, at most iters iterations each
+	void train(std::vector<unsigned char> const & data, HIKMTree const & init, int iters);
+
+	// trains the tree on a raw file of descriptors that doesn't have to fit
+	// in memory. Nodes with more than memCount descriptors make passes over
+	// their file and write the partitions of their children to a directory
+	// of their own in tmpDir, removed when training ends
+	void train(std::string const & fname, std::string const & tmpDir, size_t memCount);
+
+	// Splits the leaf centers more than maxPopulation of the descriptors
+	// fall into, or, given the documents of every word, the ones in more
+	// than maxDocs documents. Such a center gets a child node trained on its
+	// descriptors, the other centers of its leaf get single-center children
+	// that keep their words. New centers over the limit are split again, at
+	// most passes times. Returns the centers split. The words are renumbered.
+	// 0 for maxPopulation or maxDocs - no such limit
+	size_t split(std::vector<SiftDescr> const & data, size_t maxPopulation, 
+		std::vector<size_t> const * docs = nullptr, size_t maxDocs = 0, int passes = 4);
+
+	// training writes a JSON line per node to os: depth, path, descriptors,
+	// iterations, time, energy and cluster sizes. nullptr - no records
+	void setTrainLog(std::ostream* os) { mTrainLog = os; }
+
+	// path of center indices from the root
 	void push(SiftDescr const * data, std::vector<unsigned int> & word) const;
 	void push(std::vector<SiftDescr> const & data, std::vector<unsigned int> & word);
+	// dense leaf id 1..maxWord()
 	void push(SiftDescr const * data, unsigned int & word) const;
 	void push(std::vector<SiftDescr> const & data, unsigned int & word);
+	void push(SiftDescr const * data, unsigned int & word, PushStats& stats) const;
+
+	using Quantizer::push;
 
-	void push(Image& img);
+	// push skips the centers that the distances between the centers prove
+	// farther than the best one so far. The words don't depend on it
+	void setPruning(bool prune) { mPrune = prune; }
 
 	unsigned int maxWord() const;
 
+	// words whose centers differ from the ones at the same place in other
+	size_t movedWords(HIKMTree const & other) const;
+
 	int Dims() const { return vl_hikm_get_ndims(mTree); }
 	int Clusters() const { return vl_hikm_get_K(mTree); }
 	int Leaves() const { return mLeaves; }
 	int Depth() const { return vl_hikm_get_depth(mTree); }
 
+	void setThreads(unsigned threads) { mParams.threads = threads; }
+
 	void save(std::string const & fname) const;
 	void save(std::ostream& os) const;
 
@@ -69,7 +135,15 @@ public:
 
 private:
 
-	void Init(int dims, int clusters, VlIKMAlgorithms method);
+	void Init(int dims, int clusters, Method method);
+
+	void trainFrom(std::vector<unsigned char> const & data, VlHIKMNode const * init, int iters);
+
+	// numbers the centers of the leaves
+	void index();
+
+	// word of the descriptor, path gets the center indices
+	unsigned int descend(SiftDescr const * data, unsigned int * path, PushStats* stats) const;
 
 	HIKMTree(HIKMTree const & reff);
 
@@ -77,7 +151,30 @@ private:
 
 	int mLeaves;
 
-	mutable std::vector<unsigned int> mWordBuf;
+	Params mParams;
+
+	std::ostream* mTrainLog;
+
+	// the vlfeat nodes in breadth first order, children of a node are
+	// consecutive. Leaf centers are the words firstWord, firstWord + 1...
+	struct WordNode
+	{
+		VlIKMFilt* filter;
+		// index of the first child, 0 - leaf
+		unsigned int children;
+		unsigned int firstWord;
+		// offsets of the centers and of the K x K squared distances
+		// between them in mCenters and mInterDist
+		size_t centers;
+		size_t inter;
+	};
+
+	std::vector<WordNode> mNodes;
+	unsigned int mWords;
+
+	std::vector<int16_t> mCenters;
+	std::vector<uint32_t> mInterDist;
+	bool mPrune;
 
 };
 
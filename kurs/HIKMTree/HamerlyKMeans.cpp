@@ -0,0 +1,285 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAMERLY_SSE2
+#endif
+
+#include "HamerlyKMeans.hpp"
+#include "Util/threads.hpp"
+
+namespace
+{
+	size_t const GRAIN = 1024;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+void HamerlyKMeans::Report::add(std::vector<IterStats> const & stats)
+{
+	boost::lock_guard<boost::mutex> lock(mMutex);
+	if (mIters.size() < stats.size())
+		mIters.resize(stats.size());
+	for (size_t i = 0; i < stats.size(); ++i)
+	{
+		mIters[i].computed += stats[i].computed;
+		mIters[i].skipped += stats[i].skipped;
+	}
+}
+
+void HamerlyKMeans::Report::print(std::ostream& os) const
+{
+	boost::lock_guard<boost::mutex> lock(mMutex);
+	for (size_t i = 0; i < mIters.size(); ++i)
+	{
+		size_t total = mIters[i].computed + mIters[i].skipped;
+		os << "hamerly iteration " << i << ": " << mIters[i].computed << " distances, "
+			<< mIters[i].skipped << " skipped (" << (total ? 100.0 * mIters[i].skipped / total : 0.0) << "%)\n";
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+HamerlyKMeans::HamerlyKMeans(ThreadPool& pool, int M, int K) :
+	mPool(pool),
+	mM(M),
+	mK(K)
+{
+}
+
+uint32_t HamerlyKMeans::distance(SiftDescr const * x, int16_t const * c, int M)
+{
+	int j = 0;
+	uint32_t d = 0;
+
+#ifdef HAMERLY_SSE2
+	// |x - c| < 256, so a pair of squares fits the 32 bit lanes of madd
+	__m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+	for (; j + 16 <= M; j += 16)
+	{
+		__m128i xb = _mm_loadu_si128(reinterpret_cast<__m128i const *>(x + j));
+		__m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(xb, zero), _mm_loadu_si128(reinterpret_cast<__m128i const *>(c + j)));
+		__m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(xb, zero), _mm_loadu_si128(reinterpret_cast<__m128i const *>(c + j + 8)));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+	}
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+	d = (uint32_t)_mm_cvtsi128_si32(acc);
+#endif
+
+	for (; j < M; ++j)
+	{
+		int t = (int)x[j] - c[j];
+		d += t * t;
+	}
+	return d;
+}
+
+void HamerlyKMeans::assign(SiftDescr const * data, size_t N, bool first, size_t& changed, IterStats& stats)
+{
+	int const M = mM;
+	int const K = mK;
+	boost::mutex mutex;
+
+	parallelFor(mPool, 0, N, GRAIN, [&](size_t b, size_t e)
+	{
+		IterStats local;
+		size_t moved = 0;
+
+		for (size_t i = b; i < e; ++i)
+		{
+			SiftDescr const * x = data + i * M;
+			uint32_t a = mAssign[i];
+
+			if (!first)
+			{
+				double z = std::max(mHalf[a], mLower[i]);
+				if (mUpper[i] <= z)
+				{
+					local.skipped += K;
+					continue;
+				}
+
+				// tighten the upper bound and try again
+				mUpper[i] = sqrt((double)distance(x, &mCenters[(size_t)a * M], M));
+				++local.computed;
+				if (mUpper[i] <= z)
+				{
+					local.skipped += K - 1;
+					continue;
+				}
+			}
+
+			// closest and second closest of all centers, ties go to the
+			// smaller index
+			uint32_t best = 0;
+			uint32_t d1 = std::numeric_limits<uint32_t>::max();
+			uint32_t d2 = std::numeric_limits<uint32_t>::max();
+			for (int k = 0; k < K; ++k)
+			{
+				uint32_t d;
+				if (!first && (uint32_t)k == a)
+				{
+					d = (uint32_t)(mUpper[i] * mUpper[i] + 0.5);
+				}
+				else
+				{
+					d = distance(x, &mCenters[(size_t)k * M], M);
+					++local.computed;
+				}
+
+				if (d < d1)
+				{
+					d2 = d1;
+					d1 = d;
+					best = k;
+				}
+				else if (d < d2)
+				{
+					d2 = d;
+				}
+			}
+
+			if (first || best != a)
+				++moved;
+			mAssign[i] = best;
+			mUpper[i] = sqrt((double)d1);
+			mLower[i] = K > 1 ? sqrt((double)d2) : std::numeric_limits<double>::max();
+		}
+
+		boost::lock_guard<boost::mutex> lock(mutex);
+		stats.computed += local.computed;
+		stats.skipped += local.skipped;
+		changed += moved;
+	});
+}
+
+int HamerlyKMeans::train(SiftDescr const * data, size_t N, int32_t* centers, int maxIters)
+{
+	int const M = mM;
+	int const K = mK;
+
+	mStats.clear();
+	if (N == 0 || K == 0)
+		return 0;
+
+	mCenters.resize((size_t)K * M);
+	for (size_t j = 0; j < mCenters.size(); ++j)
+		mCenters[j] = (int16_t)std::min(std::max(centers[j], 0), 255);
+
+	mAssign.assign(N, 0);
+	mUpper.assign(N, 0);
+	mLower.assign(N, 0);
+	mHalf.assign(K, 0);
+
+	std::vector<int16_t> old(mCenters.size());
+	std::vector<double> move(K);
+	std::vector<size_t> offs(K + 1);
+	std::vector<uint32_t> order(N);
+
+	int iter = 0;
+	for (; iter < maxIters; ++iter)
+	{
+		// half distance to the closest other center: a descriptor closer
+		// than that to its center can't be closer to any other one
+		parallelFor(mPool, 0, K, 16, [&](size_t b, size_t e)
+		{
+			for (size_t k = b; k < e; ++k)
+			{
+				int16_t const * c = &mCenters[k * M];
+				uint32_t dmin = std::numeric_limits<uint32_t>::max();
+				for (int o = 0; o < K; ++o)
+				{
+					if ((size_t)o == k)
+						continue;
+					int16_t const * p = &mCenters[(size_t)o * M];
+					uint32_t d = 0;
+					for (int j = 0; j < M; ++j)
+						d += (c[j] - p[j]) * (c[j] - p[j]);
+					dmin = std::min(dmin, d);
+				}
+				mHalf[k] = K > 1 ? sqrt((double)dmin) / 2 : std::numeric_limits<double>::max();
+			}
+		});
+
+		IterStats stats;
+		size_t changed = 0;
+		assign(data, N, iter == 0, changed, stats);
+		mStats.push_back(stats);
+
+		if (changed == 0)
+			break;
+
+		// move the centers to the rounded means, empty clusters stay
+		std::fill(offs.begin(), offs.end(), 0);
+		for (size_t i = 0; i < N; ++i)
+			++offs[mAssign[i] + 1];
+		for (int k = 0; k < K; ++k)
+			offs[k + 1] += offs[k];
+		{
+			std::vector<size_t> pos(offs.begin(), offs.end() - 1);
+			for (size_t i = 0; i < N; ++i)
+				order[pos[mAssign[i]]++] = i;
+		}
+
+		old = mCenters;
+		parallelFor(mPool, 0, K, 16, [&](size_t b, size_t e)
+		{
+			std::vector<uint64_t> sum(M);
+			for (size_t k = b; k < e; ++k)
+			{
+				size_t n = offs[k + 1] - offs[k];
+				move[k] = 0;
+				if (!n)
+					continue;
+
+				std::fill(sum.begin(), sum.end(), 0);
+				for (size_t o = offs[k]; o < offs[k + 1]; ++o)
+				{
+					SiftDescr const * x = data + (size_t)order[o] * M;
+					for (int j = 0; j < M; ++j)
+						sum[j] += x[j];
+				}
+
+				uint32_t d = 0;
+				for (int j = 0; j < M; ++j)
+				{
+					int16_t c = (int16_t)((sum[j] + n / 2) / n);
+					d += (c - old[k * M + j]) * (c - old[k * M + j]);
+					mCenters[k * M + j] = c;
+				}
+				move[k] = sqrt((double)d);
+			}
+		});
+
+		// the bounds follow the centers
+		int far = (int)(std::max_element(move.begin(), move.end()) - move.begin());
+		double farMove = move[far];
+		if (farMove == 0)
+		{
+			++iter;
+			break;
+		}
+		double nextMove = 0;
+		for (int k = 0; k < K; ++k)
+			if (k != far)
+				nextMove = std::max(nextMove, move[k]);
+
+		parallelFor(mPool, 0, N, GRAIN, [&](size_t b, size_t e)
+		{
+			for (size_t i = b; i < e; ++i)
+			{
+				uint32_t a = mAssign[i];
+				mUpper[i] += move[a];
+				mLower[i] -= (int)a == far ? nextMove : farMove;
+			}
+		});
+	}
+
+	std::copy(mCenters.begin(), mCenters.end(), centers);
+	return iter;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+#include <stdint.h>
+
+#include "Util/types.hpp"
+
+class ThreadPool;
+
+// Integer k-means over byte descriptors with Hamerly's bounds. Every
+// descriptor keeps an upper bound on the distance to its center and a lower
+// bound on the distance to any other one; it is compared with all centers
+// only when the bounds can't prove its assignment. Assignment runs on the
+// pool, distances use SSE2 when available.
+class HamerlyKMeans
+{
+public:
+	// distance computations of one iteration
+	struct IterStats
+	{
+		IterStats() :
+			computed(0),
+			skipped(0)
+		{
+		}
+
+		size_t computed;
+		size_t skipped;
+	};
+
+	// sums the iterations of many runs, may be shared between threads
+	class Report
+	{
+	public:
+		void add(std::vector<IterStats> const & stats);
+		void print(std::ostream& os) const;
+
+	private:
+		mutable boost::mutex mMutex;
+		std::vector<IterStats> mIters;
+	};
+
+	HamerlyKMeans(ThreadPool& pool, int M, int K);
+
+	// refines the K x M centers on N descriptors, at most maxIters
+	// iterations. Returns the iterations made
+	int train(SiftDescr const * data, size_t N, int32_t* centers, int maxIters);
+
+	std::vector<IterStats> const & stats() const { return mStats; }
+
+	// squared distance between a descriptor and a center
+	static uint32_t distance(SiftDescr const * x, int16_t const * c, int M);
+
+private:
+	void assign(SiftDescr const * data, size_t N, bool first, size_t& changed, IterStats& stats);
+
+	ThreadPool& mPool;
+	int mM;
+	int mK;
+
+	std::vector<int16_t> mCenters;
+	// center of every descriptor and the bounds
+	std::vector<uint32_t> mAssign;
+	std::vector<double> mUpper;
+	std::vector<double> mLower;
+	// half distance from every center to the closest other one
+	std::vector<double> mHalf;
+
+	std::vector<IterStats> mStats;
+};
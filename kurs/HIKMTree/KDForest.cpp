@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <limits>
+#include <queue>
+
+#include "KDForest.hpp"
+#include "Util/util.hpp"
+
+namespace
+{
+	// dimensions with the largest variance a split is picked from
+	int const SPLIT_CANDIDATES = 5;
+	// points the variance is estimated on
+	size_t const VARIANCE_SAMPLE = 100;
+
+	struct Branch
+	{
+		float bound;
+		uint32_t tree;
+		uint32_t node;
+
+		bool operator< (Branch const & b) const
+		{
+			// std::priority_queue is a max heap
+			return bound > b.bound;
+		}
+	};
+}
+
+KDForest::KDForest() :
+	mData(0),
+	mCount(0),
+	mDims(0)
+{
+}
+
+void KDForest::build(float const * data, size_t count, int dims, int trees, uint64_t seed)
+{
+	mData = data;
+	mCount = count;
+	mDims = dims;
+
+	mTrees.assign(trees, Tree());
+	for (int t = 0; t < trees; ++t)
+	{
+		std::vector<uint32_t> idx(count);
+		for (size_t i = 0; i < count; ++i)
+			idx[i] = i;
+
+		uint64_t state = mix(seed + t);
+		for (size_t i = count; i > 1; --i)
+		{
+			state = mix(state);
+			std::swap(idx[i - 1], idx[state % i]);
+		}
+
+		mTrees[t].reserve(2 * count);
+		if (count)
+			build(mTrees[t], &idx.front(), count, state);
+	}
+}
+
+uint32_t KDForest::build(Tree& tree, uint32_t* idx, size_t count, uint64_t& state)
+{
+	uint32_t id = tree.size();
+	tree.push_back(Node());
+
+	if (count == 1)
+	{
+		tree[id].dim = -1;
+		tree[id].index = idx[0];
+		return id;
+	}
+
+	// variance of the dimensions on a sample of the points
+	size_t n = std::min(count, VARIANCE_SAMPLE);
+	std::vector<double> mean(mDims, 0), var(mDims, 0);
+	for (size_t i = 0; i < n; ++i)
+		for (int d = 0; d < mDims; ++d)
+			mean[d] += mData[(size_t)idx[i] * mDims + d];
+	for (int d = 0; d < mDims; ++d)
+		mean[d] /= n;
+	for (size_t i = 0; i < n; ++i)
+		for (int d = 0; d < mDims; ++d)
+		{
+			double t = mData[(size_t)idx[i] * mDims + d] - mean[d];
+			var[d] += t * t;
+		}
+
+	std::vector<int> dims(mDims);
+	for (int d = 0; d < mDims; ++d)
+		dims[d] = d;
+	int cand = std::min(SPLIT_CANDIDATES, mDims);
+	std::partial_sort(dims.begin(), dims.begin() + cand, dims.end(),
+		[&var](int a, int b) { return var[a] > var[b] || (var[a] == var[b] && a < b); });
+
+	state = mix(state);
+	int dim = dims[state % cand];
+	float split = (float)mean[dim];
+
+	uint32_t* mid = std::partition(idx, idx + count,
+		[this, dim, split](uint32_t i) { return mData[(size_t)i * mDims + dim] < split; });
+
+	if (mid == idx || mid == idx + count)
+	{
+		// the sample missed the spread, split between the extremes
+		float lo = std::numeric_limits<float>::max();
+		float hi = -lo;
+		for (size_t i = 0; i < count; ++i)
+		{
+			lo = std::min(lo, mData[(size_t)idx[i] * mDims + dim]);
+			hi = std::max(hi, mData[(size_t)idx[i] * mDims + dim]);
+		}
+		split = lo + (hi - lo) / 2;
+		mid = std::partition(idx, idx + count,
+			[this, dim, split](uint32_t i) { return mData[(size_t)i * mDims + dim] < split; });
+
+		if (mid == idx || mid == idx + count)
+		{
+			// equal along this dimension, halve the points
+			mid = idx + count / 2;
+		}
+	}
+
+	uint32_t left = build(tree, idx, mid - idx, state);
+	uint32_t right = build(tree, mid, idx + count - mid, state);
+
+	tree[id].dim = dim;
+	tree[id].split = split;
+	tree[id].left = left;
+	tree[id].right = right;
+	return id;
+}
+
+float KDForest::distance(float const * x, size_t i) const
+{
+	float const * p = mData + i * mDims;
+	float d = 0;
+	for (int j = 0; j < mDims; ++j)
+	{
+		float t = x[j] - p[j];
+		d += t * t;
+	}
+	return d;
+}
+
+size_t KDForest::query(float const * x, int checks, float* dist) const
+{
+	size_t best = 0;
+	float bestDist = std::numeric_limits<float>::max();
+	int checked = 0;
+
+	std::priority_queue<Branch> heap;
+	for (size_t t = 0; t < mTrees.size(); ++t)
+	{
+		if (mTrees[t].empty())
+			continue;
+		Branch b = { 0, (uint32_t)t, 0 };
+		heap.push(b);
+	}
+
+	while (!heap.empty() && (checked < checks || checked == 0))
+	{
+		Branch b = heap.top();
+		heap.pop();
+		if (b.bound >= bestDist)
+			continue;
+
+		Tree const & tree = mTrees[b.tree];
+		uint32_t node = b.node;
+		while (tree[node].dim >= 0)
+		{
+			Node const & n = tree[node];
+			float diff = x[n.dim] - n.split;
+			Branch far = { b.bound + diff * diff, b.tree, diff < 0 ? n.right : n.left };
+			heap.push(far);
+			node = diff < 0 ? n.left : n.right;
+		}
+
+		size_t i = tree[node].index;
+		float d = distance(x, i);
+		++checked;
+		if (d < bestDist || (d == bestDist && i < best))
+		{
+			bestDist = d;
+			best = i;
+		}
+	}
+
+	if (dist)
+		*dist = bestDist;
+	return best;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include <stdint.h>
+
+// Randomized kd-trees for approximate nearest neighbour search over float
+// points. Each tree splits on a dimension picked at random among the ones
+// with the largest variance; queries search all trees best-bin-first.
+class KDForest
+{
+public:
+	KDForest();
+
+	// the points are not copied and must outlive the forest
+	void build(float const * data, size_t count, int dims, int trees, uint64_t seed);
+
+	// index of the approximate nearest point, at most checks points are
+	// compared. dist gets its squared distance
+	size_t query(float const * x, int checks, float* dist = 0) const;
+
+	size_t size() const { return mCount; }
+
+private:
+	struct Node
+	{
+		// split dimension, -1 for a leaf
+		int dim;
+		float split;
+		// point of a leaf
+		uint32_t index;
+		// children of an inner node
+		uint32_t left;
+		uint32_t right;
+	};
+
+	typedef std::vector<Node> Tree;
+
+	uint32_t build(Tree& tree, uint32_t* idx, size_t count, uint64_t& state);
+
+	float distance(float const * x, size_t i) const;
+
+	float const * mData;
+	size_t mCount;
+	int mDims;
+
+	std::vector<Tree> mTrees;
+};
@@ -0,0 +1,46 @@
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "Quantizer.hpp"
+#include "AKMVocab.hpp"
+#include "HIKMTree.hpp"
+#include "Util/util.hpp"
+#include "Image/Image.hpp"
+
+void Quantizer::push(Image& img)
+{
+	TRACE;
+
+	int const M = Dims();
+	if (M != 128)
+		throw std::runtime_error("The vocabulary doesn't have the 128 dimensions of sift descriptors");
+
+	auto & iwords = img.getWords();
+	auto    idscr = img.getDescr();
+	auto   nidscr = img.getDescrCount();
+
+	iwords.clear();
+	iwords.resize(nidscr);
+	for (size_t i = 0; i < nidscr; ++i)
+	{
+		push(&idscr[i * M], iwords[i]);
+	}
+}
+
+std::unique_ptr<Quantizer> Quantizer::open(std::string const & fname)
+{
+	char magic[sizeof(AKMVocab::MAGIC)];
+	{
+		std::ifstream ifs(fname.c_str(), std::ifstream::binary);
+		if (!ifs)
+			throw std::runtime_error("Cannot open vocabulary " + fname);
+		ifs.read(magic, sizeof(magic));
+		if (!ifs)
+			memset(magic, 0, sizeof(magic));
+	}
+
+	if (!memcmp(magic, AKMVocab::MAGIC, sizeof(magic)))
+		return std::unique_ptr<Quantizer>(new AKMVocab(fname));
+	return std::unique_ptr<Quantizer>(new HIKMTree(fname));
+}
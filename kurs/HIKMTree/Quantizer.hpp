@@ -0,0 +1,31 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "Util/types.hpp"
+
+class Image;
+
+// Maps sift descriptors to visual words 1..maxWord(), 0 is not a word
+class Quantizer
+{
+public:
+	virtual ~Quantizer() {}
+
+	virtual void push(SiftDescr const * data, Word & word) const = 0;
+
+	// fills the words of the image from its descriptors, which are sift
+	// ones, so the vocabulary must have 128 dimensions
+	virtual void push(Image& img);
+
+	// dimensions of the descriptors
+	virtual int Dims() const = 0;
+
+	virtual unsigned int maxWord() const = 0;
+
+	virtual void save(std::string const & fname) const = 0;
+
+	// loads a vocabulary of any type from the file
+	static std::unique_ptr<Quantizer> open(std::string const & fname);
+};
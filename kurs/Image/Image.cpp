@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <cstring>
 #include <exception>
 #include <stdexcept>
 #include <fstream>
@@ -9,6 +11,42 @@
 
 #include "Sift/Sift.hpp"
 
+namespace
+{
+	// LEB128: 7 bits a byte, the high bit marks a following byte
+	void writeVarint(std::ostream& os, uint64_t v)
+	{
+		char buf[10];
+		int n = 0;
+		do
+		{
+			buf[n] = (char)(v & 0x7F);
+			v >>= 7;
+			if (v)
+				buf[n] |= 0x80;
+			++n;
+		} while (v);
+		os.write(buf, n);
+	}
+
+	uint64_t readVarint(std::istream& is)
+	{
+		uint64_t v = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			int c = is.get();
+			if (c == EOF)
+				throw std::runtime_error("Truncated word file");
+			v |= (uint64_t)(c & 0x7F) << shift;
+			if (!(c & 0x80))
+				return v;
+		}
+		throw std::runtime_error("Broken word file");
+	}
+}
+
+char const Image::WORDS_MAGIC[8] = { 'B', 'O', 'W', 'H', 'I', 'S', 'T', '1' };
+
 Image::Image(std::string fname):
 	pimpl(new Image_pimpl),
 	mFname(fname),
@@ -135,21 +173,64 @@ size_t Image::getDescrCount() const
 
 std::vector<Word> & Image::getWords()
 {
+	if (mWords.empty())
+	{
+		for (auto it = mHist.begin(); it != mHist.end(); ++it)
+			mWords.insert(mWords.end(), it->count, it->word);
+	}
+	// the caller may change them
+	mHist.clear();
 	return mWords;
 }
 
+WordHist const & Image::getHist()
+{
+	if (mHist.empty())
+		makeHist(mWords, mHist);
+	return mHist;
+}
+
+void Image::makeHist(std::vector<Word> const & words, WordHist& hist)
+{
+	std::vector<Word> sorted(words);
+	std::sort(sorted.begin(), sorted.end());
+
+	hist.clear();
+	for (size_t i = 0; i < sorted.size(); )
+	{
+		size_t j = i;
+		while (j < sorted.size() && sorted[j] == sorted[i])
+			++j;
+		WordCount wc = { sorted[i], (uint32_t)(j - i) };
+		hist.push_back(wc);
+		i = j;
+	}
+}
+
 //////////////////////////////////////////////////////////////////////////
 
 std::ostream& operator<<(std::ostream& os, Image const & img)
 {
 	//os << img.mFname;
 
-	if (img.mWords.size() == 0)
+	WordHist local;
+	if (img.mHist.empty())
+		Image::makeHist(img.mWords, local);
+	WordHist const & hist = img.mHist.empty() ? local : img.mHist;
+
+	if (hist.size() == 0)
 		throw std::runtime_error("No words in image");
 
-	WRITE(img.mWords.size());
-	os.write(reinterpret_cast<char const*>(&img.mWords.front()), 
-		sizeof(img.mWords[0]) * img.mWords.size());
+	// distinct words, then the word deltas and the counts
+	os.write(Image::WORDS_MAGIC, sizeof(Image::WORDS_MAGIC));
+	writeVarint(os, hist.size());
+	Word prev = 0;
+	for (auto it = hist.begin(); it != hist.end(); ++it)
+	{
+		writeVarint(os, it->word - prev);
+		writeVarint(os, it->count);
+		prev = it->word;
+	}
 
 	return os;
 }
@@ -158,12 +239,40 @@ std::istream& operator>>(std::istream& is, Image & img)
 {
 	//is >> img.mFname;
 
-	size_t s;
-	READ(s);
-
-	img.mWords.resize(s);
-	is.read(reinterpret_cast<char*>(&img.mWords.front()), 
-		sizeof(img.mWords[0]) * s);
+	img.mWords.clear();
+	img.mHist.clear();
+
+	// the word count of the old files never looks like the magic
+	char magic[sizeof(Image::WORDS_MAGIC)];
+	is.read(magic, sizeof(magic));
+	if (!is)
+		throw std::runtime_error("Not a word file");
+
+	if (memcmp(magic, Image::WORDS_MAGIC, sizeof(magic)))
+	{
+		size_t s;
+		memcpy(&s, magic, sizeof(s));
+		// with a 32 bit size_t the first word was read with the magic
+		size_t const rest = sizeof(magic) - sizeof(s);
+		if (s == 0 || s * sizeof(Word) < rest)
+			throw std::runtime_error("Broken word file");
+
+		img.mWords.resize(s);
+		char* dst = reinterpret_cast<char*>(&img.mWords.front());
+		memcpy(dst, magic + sizeof(s), rest);
+		is.read(dst + rest, sizeof(img.mWords[0]) * s - rest);
+		return is;
+	}
+
+	size_t s = (size_t)readVarint(is);
+	img.mHist.resize(s);
+	Word prev = 0;
+	for (size_t i = 0; i < s; ++i)
+	{
+		prev += (Word)readVarint(is);
+		img.mHist[i].word = prev;
+		img.mHist[i].count = (uint32_t)readVarint(is);
+	}
 
 	return is;
 }
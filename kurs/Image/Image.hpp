@@ -45,15 +45,26 @@ public:
 	SiftDescr const* getDescr() const;
 	size_t getDescrCount() const;
 
+	// word of every descriptor. The histogram is made again after a change
 	std::vector<Word> & getWords();
+	// sorted bag of the words
+	WordHist const & getHist();
+
+	// first bytes of a histogram word file, older ones hold a word per
+	// descriptor
+	static char const WORDS_MAGIC[8];
 
 private:
 
+	static void makeHist(std::vector<Word> const & words, WordHist& hist);
+
 	Image_pimpl* pimpl;
 
 	std::string mFname;
 
+	// either may be empty while the other one holds the words
 	std::vector<Word> mWords;
+	WordHist mHist;
 
 	SiftDescr* mpDescr;
 	size_t mDescrCount;
@@ -0,0 +1,244 @@
+#include <algorithm>
+
+#include "threads.hpp"
+
+ThreadPool::ThreadPool(unsigned threads) :
+	mSize(threads ? threads : hardwareThreads()),
+	mPending(0),
+	mStop(false)
+{
+	// queue 0 is shared by the threads outside the pool
+	for (unsigned i = 0; i < mSize; ++i)
+		mQueues.push_back(new Queue);
+
+	for (unsigned i = 1; i < mSize; ++i)
+		mIds.push_back(mThreads.create_thread(std::bind(&ThreadPool::work, this, i))->get_id());
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		boost::lock_guard<boost::mutex> lock(mSleepMutex);
+		mStop = true;
+	}
+	mWake.notify_all();
+	mThreads.join_all();
+
+	for (size_t i = 0; i < mQueues.size(); ++i)
+		delete mQueues[i];
+}
+
+unsigned ThreadPool::hardwareThreads()
+{
+	return std::max(1u, boost::thread::hardware_concurrency());
+}
+
+size_t ThreadPool::self() const
+{
+	auto it = std::find(mIds.begin(), mIds.end(), boost::this_thread::get_id());
+	return it == mIds.end() ? 0 : it - mIds.begin() + 1;
+}
+
+void ThreadPool::submit(Task task)
+{
+	if (mSize == 1)
+	{
+		task();
+		return;
+	}
+
+	// counted under the same lock, so a worker that took the task can't
+	// decrement the count before it was incremented
+	Queue& q = *mQueues[self()];
+	{
+		boost::lock_guard<boost::mutex> sleep(mSleepMutex);
+		boost::lock_guard<boost::mutex> lock(q.mutex);
+		q.tasks.push_back(task);
+		++mPending;
+	}
+	mWake.notify_one();
+}
+
+bool ThreadPool::take(size_t self, Task& task)
+{
+	{
+		Queue& q = *mQueues[self];
+		boost::lock_guard<boost::mutex> lock(q.mutex);
+		if (!q.tasks.empty())
+		{
+			task = q.tasks.back();
+			q.tasks.pop_back();
+			return true;
+		}
+	}
+
+	for (size_t i = 1; i < mQueues.size(); ++i)
+	{
+		Queue& q = *mQueues[(self + i) % mQueues.size()];
+		boost::lock_guard<boost::mutex> lock(q.mutex);
+		if (!q.tasks.empty())
+		{
+			task = q.tasks.front();
+			q.tasks.pop_front();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool ThreadPool::runPending()
+{
+	Task task;
+	if (!take(self(), task))
+		return false;
+
+	{
+		boost::lock_guard<boost::mutex> lock(mSleepMutex);
+		--mPending;
+	}
+	task();
+	return true;
+}
+
+void ThreadPool::work(size_t self)
+{
+	Task task;
+	while (true)
+	{
+		if (take(self, task))
+		{
+			{
+				boost::lock_guard<boost::mutex> lock(mSleepMutex);
+				--mPending;
+			}
+			task();
+			task = Task();
+			continue;
+		}
+
+		boost::unique_lock<boost::mutex> lock(mSleepMutex);
+		while (!mStop && mPending == 0)
+			mWake.wait(lock);
+		if (mStop && mPending == 0)
+			return;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+TaskGroup::TaskGroup(ThreadPool& pool) :
+	mPool(pool),
+	mActive(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+	try
+	{
+		wait();
+	}
+	catch (...)
+	{
+	}
+}
+
+void TaskGroup::fail()
+{
+	boost::lock_guard<boost::mutex> lock(mMutex);
+	if (!mError)
+		mError = std::current_exception();
+}
+
+void TaskGroup::run(ThreadPool::Task task)
+{
+	if (mPool.size() == 1)
+	{
+		try
+		{
+			task();
+		}
+		catch (...)
+		{
+			fail();
+		}
+		return;
+	}
+
+	{
+		boost::lock_guard<boost::mutex> lock(mMutex);
+		++mActive;
+	}
+
+	mPool.submit([this, task]()
+	{
+		try
+		{
+			task();
+		}
+		catch (...)
+		{
+			fail();
+		}
+
+		boost::lock_guard<boost::mutex> lock(mMutex);
+		if (--mActive == 0)
+			mDone.notify_all();
+	});
+}
+
+void TaskGroup::wait()
+{
+	while (true)
+	{
+		{
+			boost::lock_guard<boost::mutex> lock(mMutex);
+			if (mActive == 0)
+				break;
+		}
+
+		if (mPool.runPending())
+			continue;
+
+		// our tasks are running elsewhere; wake up now and then to help
+		// with the tasks they spawn
+		boost::unique_lock<boost::mutex> lock(mMutex);
+		if (mActive != 0)
+			mDone.timed_wait(lock, boost::posix_time::milliseconds(1));
+	}
+
+	std::exception_ptr error;
+	{
+		boost::lock_guard<boost::mutex> lock(mMutex);
+		std::swap(error, mError);
+	}
+	if (error)
+		std::rethrow_exception(error);
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+void parallelFor(ThreadPool& pool, size_t begin, size_t end, size_t grain,
+	std::function<void(size_t, size_t)> const & fn)
+{
+	if (begin >= end)
+		return;
+
+	size_t n = end - begin;
+	size_t step = std::max(std::max<size_t>(grain, 1), (n + 4 * pool.size() - 1) / (4 * pool.size()));
+
+	if (pool.size() == 1 || step >= n)
+	{
+		fn(begin, end);
+		return;
+	}
+
+	TaskGroup group(pool);
+	for (size_t b = begin; b < end; b += step)
+	{
+		size_t e = std::min(end, b + step);
+		group.run([&fn, b, e]() { fn(b, e); });
+	}
+	group.wait();
+}
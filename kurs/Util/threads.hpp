@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+//////////////////////////////////////////////////////////////////////////
+// Work-stealing thread pool.
+//
+// Every worker owns a deque: tasks submitted from a worker go to the back of
+// its own deque and are taken back LIFO, idle workers steal from the front of
+// the other deques. Threads outside the pool share one extra deque.
+// A pool of size 1 has no workers: everything runs on the calling thread.
+
+class ThreadPool
+{
+public:
+	typedef std::function<void()> Task;
+
+	// threads - total concurrency including the thread that waits on the
+	//           tasks, 0 means one per hardware thread
+	explicit ThreadPool(unsigned threads = 0);
+	~ThreadPool();
+
+	unsigned size() const { return mSize; }
+
+	void submit(Task task);
+
+	// run one pending task on the calling thread, false if there was none
+	bool runPending();
+
+	static unsigned hardwareThreads();
+
+private:
+	struct Queue
+	{
+		boost::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	ThreadPool(ThreadPool const &);
+	ThreadPool& operator=(ThreadPool const &);
+
+	size_t self() const;
+	bool take(size_t self, Task& task);
+	void work(size_t self);
+
+	unsigned mSize;
+
+	std::vector<Queue*> mQueues;
+	std::vector<boost::thread::id> mIds;
+	boost::thread_group mThreads;
+
+	boost::mutex mSleepMutex;
+	boost::condition_variable mWake;
+	size_t mPending;
+	bool mStop;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Set of tasks that can be waited for. The waiting thread runs pending tasks
+// of the pool instead of blocking, so groups can be nested in the tasks.
+// The first exception thrown by a task is rethrown from wait().
+
+class TaskGroup
+{
+public:
+	explicit TaskGroup(ThreadPool& pool);
+	~TaskGroup();
+
+	void run(ThreadPool::Task task);
+	void wait();
+
+private:
+	TaskGroup(TaskGroup const &);
+	TaskGroup& operator=(TaskGroup const &);
+
+	void fail();
+
+	ThreadPool& mPool;
+
+	boost::mutex mMutex;
+	boost::condition_variable mDone;
+	size_t mActive;
+	std::exception_ptr mError;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Calls fn(b, e) for consecutive subranges of [begin, end) on the pool.
+// Subranges are at least grain long.
+
+void parallelFor(ThreadPool& pool, size_t begin, size_t end, size_t grain,
+	std::function<void(size_t, size_t)> const & fn);
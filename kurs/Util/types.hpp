@@ -1,8 +1,22 @@
 #pragma once
 
+#include <vector>
+
+#include <stdint.h>
+
 typedef unsigned char uchar;
 typedef unsigned int  uint;
 
 typedef uchar SiftDescr;
 typedef uint Word;
 
+// a distinct word of an image and the number of its descriptors
+struct WordCount
+{
+	Word word;
+	uint32_t count;
+};
+
+// bag of words of an image, ascending words
+typedef std::vector<WordCount> WordHist;
+
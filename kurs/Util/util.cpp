@@ -4,13 +4,25 @@
 
 #include "util.hpp"
 
+#if defined(WIN32)
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 Timer::Timer()
 {
 #if defined(WIN32)
 	QueryPerformanceFrequency(&ticFreq) ;
 	ticMark.QuadPart = 0;
 #else
-	ticMark = 0;
+	ticMark.tv_sec = 0;
+	ticMark.tv_nsec = 0;
 #endif
 }
 
@@ -19,7 +31,8 @@ void Timer::tic()
 #if defined(WIN32)
 	QueryPerformanceCounter (&ticMark) ;
 #else
-	ticMark = clock() ;
+	// wall clock: clock() sums the time of all threads
+	clock_gettime(CLOCK_MONOTONIC, &ticMark) ;
 #endif
 }
 
@@ -30,7 +43,9 @@ double Timer::toc()
 		QueryPerformanceCounter(&tocMark) ;
 		return (double)(tocMark.QuadPart - ticMark.QuadPart) / ticFreq.QuadPart;
 #else
-		return (double)(clock() - ticMark) / CLOCKS_PER_SEC ;
+		timespec tocMark ;
+		clock_gettime(CLOCK_MONOTONIC, &tocMark) ;
+		return (tocMark.tv_sec - ticMark.tv_sec) + (tocMark.tv_nsec - ticMark.tv_nsec) * 1e-9 ;
 #endif
 }
 
@@ -55,4 +70,67 @@ bool checkFile(std::string const & p)
 	namespace bfs = boost::filesystem;
 	bfs::path pp(p);
 	return bfs::exists(pp) && bfs::is_regular_file(pp);
+}
+
+TempDir::TempDir(std::string const & parent) :
+	path((boost::filesystem::path(parent) / boost::filesystem::unique_path("%%%%-%%%%-%%%%-%%%%")).string())
+{
+	boost::filesystem::create_directories(path);
+}
+
+TempDir::~TempDir()
+{
+	boost::system::error_code ec;
+	boost::filesystem::remove_all(path, ec);
+}
+
+size_t peakMemory()
+{
+#if defined(WIN32)
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		return 0;
+	return pmc.PeakWorkingSetSize;
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage))
+		return 0;
+	// kilobytes on linux
+	return (size_t)usage.ru_maxrss * 1024;
+#endif
+}
+
+namespace
+{
+	CpuFeatures detectCpu()
+	{
+		CpuFeatures f;
+		f.ssse3 = false;
+		f.avx2 = false;
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+		int r[4];
+		__cpuid(r, 0);
+		int top = r[0];
+		__cpuid(r, 1);
+		f.ssse3 = (r[2] & (1 << 9)) != 0;
+		// avx2 also needs the os to save the ymm registers
+		bool osxsave = (r[2] & (1 << 27)) != 0;
+		if (top >= 7 && osxsave && (_xgetbv(0) & 6) == 6)
+		{
+			__cpuidex(r, 7, 0);
+			f.avx2 = (r[1] & (1 << 5)) != 0;
+		}
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		__builtin_cpu_init();
+		f.ssse3 = __builtin_cpu_supports("ssse3") != 0;
+		f.avx2 = __builtin_cpu_supports("avx2") != 0;
+#endif
+		return f;
+	}
+}
+
+CpuFeatures const& cpuFeatures()
+{
+	static CpuFeatures const features = detectCpu();
+	return features;
 }
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include <string>
 #include <iostream>
 
+#include <stdint.h>
+
 #if defined(WIN32)
 #define WINDOWS_LEAN_AND_MEAN
 #include "Windows.h"
@@ -15,7 +17,7 @@ struct Timer {
 	LARGE_INTEGER ticFreq ;
 	LARGE_INTEGER ticMark ;
 #else
-	clock_t ticMark ;
+	timespec ticMark ;
 #endif
 
 	Timer();
@@ -50,6 +52,39 @@ void read(std::istream & is, T & t)
 
 bool checkFile(std::string const & p);
 
+// new directory of a unique name in parent, removed with everything in it
+// when it goes out of scope, so also when an exception leaves the scope
+struct TempDir {
+	explicit TempDir(std::string const & parent);
+	~TempDir();
+	std::string const path;
+private:
+	TempDir(TempDir const &);
+	TempDir& operator=(TempDir const &);
+};
+
+// peak resident memory of the process, bytes
+size_t peakMemory();
+
+// instruction sets of the cpu the program runs on, detected once
+struct CpuFeatures
+{
+	bool ssse3;
+	bool avx2;
+};
+CpuFeatures const& cpuFeatures();
+
+//////////////////////////////////////////////////////////////////////////
+
+// splitmix64 step: hashes seeds and drives the small random generators
+inline uint64_t mix(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
 //////////////////////////////////////////////////////////////////////////
 
 #ifdef __GNUC__
@@ -0,0 +1,417 @@
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <iostream>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "Image/Image.hpp"
+#include "ivfile/src/ccBlockScore.hpp"
+#include "ivfile/src/ccInvertedFile.hpp"
+#include "Util/opts.hpp"
+#include "Util/util.hpp"
+
+typedef std::vector<std::string> str_vector;
+
+// Compresses the postings of an inverted file and compares them to the raw
+// ones: memory, decode speed and the time and results of the queries. The
+// cos and hist-int queries are run with the pruning and on the impact
+// ordered postings too, and with stop word
+// limits the queries are run on the file without its frequent words. With
+// --kernels the block scoring kernels of every instruction set are run on
+// its postings, and the file is weighted and queried with every weight,
+// norm and distance.
+
+std::istream& operator>>(std::istream& is, ivFile::Dist& dist)
+{
+	std::string str;
+	is >> str;
+	if      (str == "l1")        dist = ivFile::DIST_L1;
+	else if (str == "l2")        dist = ivFile::DIST_L2;
+	else if (str == "ham")       dist = ivFile::DIST_HAM;
+	else if (str == "kl")        dist = ivFile::DIST_KL;
+	else if (str == "cos")       dist = ivFile::DIST_COS;
+	else if (str == "jac")       dist = ivFile::DIST_JAC;
+	else if (str == "hist-int")  dist = ivFile::DIST_HISTINT;
+	else throw bpo::validation_error(bpo::validation_error::invalid_option_value, str);
+	return is;
+}
+
+void prepare(int argc, char* argv[], std::string& ivfname, str_vector& word_infiles,
+	ivFile::Dist& dist, int& k, int& repeat, unsigned& threads, double& stopRatio, size_t& stopDocs,
+	bool& kernels)
+{
+	bpo::options_description desc("");
+	desc.add_options()
+		("help,h", "Help message")
+		("ivf,v", bpo::value(&ivfname)->required(), "Inverted file")
+		("words,w", bpo::value(&word_infiles), "Words files of the query images")
+		("dist,D", bpo::value(&dist), "Distance function in ivf")
+		("k,k", bpo::value(&k)->default_value(5), "Results per query")
+		("repeat,r", bpo::value(&repeat)->default_value(3), "Runs of every mode, the best one is reported")
+		("threads,j", bpo::value(&threads)->default_value(1), "Threads running the queries, 0 - one per core")
+		("stop-ratio", bpo::value(&stopRatio)->default_value(1), "Stop words: in more than this part of the documents")
+		("stop-docs", bpo::value(&stopDocs)->default_value(0), "Stop words: in more than this many documents, 0 - no limit")
+		("kernels", bpo::bool_switch(&kernels), "Time every weight, norm and distance instead")
+		;
+
+	bpo::positional_options_description p;
+	p.add("words", -1);
+
+	bpo::variables_map vm;
+	bpo::store(bpo::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
+	if (vm.count("help"))
+	{
+		std::cout << desc << std::endl;
+		exit(0);
+	}
+
+	bpo::notify(vm);
+
+	if (!(stopRatio > 0 && stopRatio <= 1))
+		throw std::logic_error("--stop-ratio must be in (0, 1]");
+}
+
+// best time of decoding all the postings, returns their number
+size_t decodeAll(ivFile const& ivf, size_t nwords, int repeat, double& best)
+{
+	std::vector<uint32_t> docs;
+	std::vector<float> vals;
+	size_t total = 0;
+
+	best = 0;
+	for (int r = 0; r < repeat; ++r)
+	{
+		total = 0;
+
+		Timer timer;
+		timer.tic();
+		for (size_t i = 0; i < nwords; ++i)
+		{
+			ivf.wordPostings(i, docs, vals);
+			total += docs.size();
+		}
+		double t = timer.toc();
+
+		if (r == 0 || t < best)
+			best = t;
+	}
+	return total;
+}
+
+double query(ivFile const& ivf, docvec const& queries, ivFile::Dist dist, int k, int repeat,
+	unsigned threads, ivNodeLists& scores, ivFile::SearchStats* stats = nullptr)
+{
+	double best = 0;
+	for (int r = 0; r < repeat; ++r)
+	{
+		scores.clear();
+
+		Timer timer;
+		timer.tic();
+		ivf.search(queries, dist, false, (uint)k, scores, false, threads, stats);
+		double t = timer.toc();
+
+		if (r == 0 || t < best)
+			best = t;
+	}
+	return best;
+}
+
+char const* const dists[] = {"l1", "l2", "ham", "kl", "cos", "jac", "hist-int"};
+
+// the block scoring kernels of every distance and instruction set on all
+// the postings, the query value is their mean
+void timeBlocks(std::string const& ivfname, int repeat)
+{
+	ivFile ivf;
+	ivf.load(ivfname);
+
+	std::vector<size_t> ndocs;
+	ivf.wordDocs(ndocs);
+	std::vector<std::vector<uint32_t> > docs(ndocs.size());
+	std::vector<std::vector<float> > vals(ndocs.size());
+	size_t count = 0, size = 0;
+	double sum = 0;
+	for (size_t i = 0; i < ndocs.size(); ++i)
+	{
+		ivf.wordPostings(i, docs[i], vals[i]);
+		count += docs[i].size();
+		if (!docs[i].empty())
+			size = std::max<size_t>(size, docs[i].back() + 1);
+		for (size_t j = 0; j < vals[i].size(); ++j)
+			sum += vals[i][j];
+	}
+	float qval = count ? (float)(sum / count) : 0;
+
+	std::cout << "  blocks: postings " << count << ", best " << ivBlockScore::name(ivBlockScore::best()) << '\n';
+	for (int d = 0; d < ivFile::DIST_LAST; ++d)
+	{
+		std::cout << "  " << dists[d] << ":";
+		std::vector<float> first;
+		double tscalar = 0;
+		for (int isa = 0; isa < ivBlockScore::ISA_LAST; ++isa)
+		{
+			ivBlockScore::Kernel kernel = ivBlockScore::kernel((ivFile::Dist)d, (ivBlockScore::Isa)isa);
+			if (!kernel)
+				continue;
+
+			std::vector<float> scores;
+			double best = 0;
+			for (int r = 0; r < repeat; ++r)
+			{
+				scores.assign(size, 0);
+
+				Timer timer;
+				timer.tic();
+				for (size_t i = 0; i < docs.size(); ++i)
+					if (!docs[i].empty())
+						kernel(qval, 0, &docs[i][0], &vals[i][0], docs[i].size(), 0, &scores[0]);
+				double t = timer.toc();
+
+				if (r == 0 || t < best)
+					best = t;
+			}
+
+			if (isa == ivBlockScore::ISA_SCALAR)
+			{
+				first.swap(scores);
+				tscalar = best;
+			}
+			std::cout << " " << ivBlockScore::name((ivBlockScore::Isa)isa) << " " << best << " s";
+			if (isa != ivBlockScore::ISA_SCALAR)
+				std::cout << " (" << (best > 0 ? tscalar / best : 0.0) << "x" 
+					<< (scores == first ? "" : ", other scores") << ")";
+		}
+		std::cout << std::endl;
+	}
+}
+
+// computeStats and the queries with every weight, norm and distance
+void timeKernels(std::string const& ivfname, docvec const& queries, int k, int repeat, unsigned threads)
+{
+	char const* const weights[] = {"none", "bin", "tf", "tfidf"};
+	char const* const norms[] = {"none", "l0", "l1", "l2"};
+
+	for (int w = 0; w < ivFile::WEIGHT_LAST; ++w)
+		for (int n = 0; n < ivFile::NORM_LAST; ++n)
+		{
+			ivFile ivf;
+			ivf.load(ivfname);
+			ivf.setParams(ivFile::Params((ivFile::Norm)n, (ivFile::Weight)w));
+
+			Timer timer;
+			timer.tic();
+			ivf.computeStats();
+			double tstats = timer.toc();
+
+			std::cout << "  " << weights[w] << " " << norms[n] << ": stats " << tstats << " s";
+			ivNodeLists scores;
+			for (int d = 0; d < ivFile::DIST_LAST && !queries.empty(); ++d)
+				std::cout << ", " << dists[d] << " " 
+					<< query(ivf, queries, (ivFile::Dist)d, k, repeat, threads, scores) << " s";
+			std::cout << std::endl;
+		}
+}
+
+// documents of b[q] that are in a[q] too, over all the queries
+size_t common(ivNodeLists const& a, ivNodeLists const& b)
+{
+	size_t n = 0;
+	for (size_t q = 0; q < a.size(); ++q)
+		for (size_t j = 0; j < b[q].size(); ++j)
+			for (size_t i = 0; i < a[q].size(); ++i)
+				if (a[q][i].id == b[q][j].id)
+				{
+					++n;
+					break;
+				}
+	return n;
+}
+
+// results in another order or with other documents and the largest
+// difference of the distances
+void compare(ivNodeLists const& a, ivNodeLists const& b, size_t& differ, float& maxError)
+{
+	for (size_t q = 0; q < a.size(); ++q)
+	{
+		ivNodeList const& al = a[q];
+		ivNodeList const& bl = b[q];
+		bool same = al.size() == bl.size();
+		for (size_t j = 0; same && j < al.size(); ++j)
+		{
+			same = al[j].id == bl[j].id;
+			maxError = std::max(maxError, std::fabs(al[j].val - bl[j].val));
+		}
+		differ += !same;
+	}
+}
+
+int main(int argc, char* argv[]) try
+{
+	std::string ivfname;
+	str_vector word_infiles;
+	ivFile::Dist dist = ivFile::DIST_L1;
+	int k = 5;
+	int repeat = 3;
+	unsigned threads = 1;
+	double stopRatio = 1;
+	size_t stopDocs = 0;
+	bool kernels = false;
+
+	prepare(argc, argv, ivfname, word_infiles, dist, k, repeat, threads, stopRatio, stopDocs, kernels);
+
+	if (!checkFile(ivfname))
+		throw std::runtime_error(ivfname + " not found");
+
+	docvec queries;
+	for (auto it = word_infiles.begin(); it != word_infiles.end(); ++it)
+	{
+		if (!checkFile(*it))
+			throw std::runtime_error(*it + " not found");
+
+		Image img("");
+		img.load(*it);
+		queries.push_back(img.getWords());
+	}
+
+	if (kernels)
+	{
+		std::cout << ivfname << ": queries " << queries.size() << '\n';
+		timeBlocks(ivfname, repeat);
+		timeKernels(ivfname, queries, k, repeat, threads);
+		return 0;
+	}
+
+	ivFile raw, packed;
+	raw.load(ivfname);
+	packed.load(ivfname);
+	packed.compress();
+
+	std::vector<size_t> ndocs;
+	raw.wordDocs(ndocs);
+	size_t nwords = ndocs.size();
+
+	double traw, tpacked;
+	size_t count = decodeAll(raw, nwords, repeat, traw);
+	decodeAll(packed, nwords, repeat, tpacked);
+
+	// exact documents, values within half a quantization step
+	size_t docsDiffer = 0;
+	float maxError = 0;
+	{
+		std::vector<uint32_t> rdocs, pdocs;
+		std::vector<float> rvals, pvals;
+		for (size_t i = 0; i < nwords; ++i)
+		{
+			raw.wordPostings(i, rdocs, rvals);
+			packed.wordPostings(i, pdocs, pvals);
+			docsDiffer += rdocs != pdocs;
+			for (size_t j = 0; j < rvals.size() && j < pvals.size(); ++j)
+				maxError = std::max(maxError, std::fabs(rvals[j] - pvals[j]));
+		}
+	}
+
+	std::cout << ivfname << ": words " << nwords << ", postings " << count
+		<< (ivPacked::simd() ? ", simd decode" : ", scalar decode") << '\n'
+		<< "  raw:    " << raw.indexBytes() << " bytes, "
+		<< (double)raw.indexBytes() / std::max<size_t>(count, 1) << " per posting, "
+		<< traw << " s to decode\n"
+		<< "  packed: " << packed.indexBytes() << " bytes, "
+		<< (double)packed.indexBytes() / std::max<size_t>(count, 1) << " per posting, "
+		<< tpacked << " s to decode, " << (tpacked > 0 ? count / tpacked / 1e6 : 0.0) << " M postings/s\n"
+		<< "  words with other documents " << docsDiffer << ", max value error " << maxError << std::endl;
+
+	if (queries.empty())
+		return 0;
+
+	ivNodeLists rawScores, packedScores;
+	double qraw = query(raw, queries, dist, k, repeat, threads, rawScores);
+	double qpacked = query(packed, queries, dist, k, repeat, threads, packedScores);
+
+	// results in another order or with other documents
+	size_t differ = 0;
+	float maxScoreError = 0;
+	compare(rawScores, packedScores, differ, maxScoreError);
+
+	std::cout << "  queries " << queries.size() << ": raw " << qraw << " s, packed " << qpacked
+		<< " s, speedup " << (qpacked > 0 ? qraw / qpacked : 0.0) << ", "
+		<< (qraw > 0 ? queries.size() / qraw : 0.0) << " raw queries/s\n"
+		<< "  results differ " << differ << ", max score error " << maxScoreError << std::endl;
+
+	if (dist == ivFile::DIST_COS || dist == ivFile::DIST_HISTINT)
+	{
+		// the raw file again, a document at a time
+		ivNodeLists prunedScores;
+		ivFile::SearchStats stats;
+		raw.setPruning(true);
+		double qpruned = query(raw, queries, dist, k, repeat, threads, prunedScores, &stats);
+		raw.setPruning(false);
+
+		differ = 0;
+		maxScoreError = 0;
+		compare(rawScores, prunedScores, differ, maxScoreError);
+
+		std::cout << "  pruned: " << qpruned << " s, speedup " << (qpruned > 0 ? qraw / qpruned : 0.0) 
+			<< ", postings " << stats.postings << ", skipped " << stats.skipped << " ("
+			<< (stats.postings ? 100.0 * stats.skipped / stats.postings : 0.0) << "%), results differ " 
+			<< differ << std::endl;
+
+		// the postings by impact, the largest contributions first
+		ivFile impact;
+		impact.load(ivfname);
+		impact.impactOrder();
+		ivNodeLists impactScores;
+		ivFile::SearchStats istats;
+		double qimpact = query(impact, queries, dist, k, repeat, threads, impactScores, &istats);
+
+		size_t nresults = 0;
+		for (size_t q = 0; q < rawScores.size(); ++q)
+			nresults += rawScores[q].size();
+
+		std::cout << "  impact: " << impact.indexBytes() << " bytes, " << qimpact << " s, speedup " 
+			<< (qimpact > 0 ? qraw / qimpact : 0.0) << ", postings " << istats.postings << ", skipped " 
+			<< istats.skipped << " (" << (istats.postings ? 100.0 * istats.skipped / istats.postings : 0.0) 
+			<< "%), results kept " << common(rawScores, impactScores) << " of " << nresults << std::endl;
+	}
+
+	if (stopRatio >= 1 && !stopDocs)
+		return 0;
+
+	// the file without its stop words, weighted again
+	ivFile stopped;
+	stopped.load(ivfname);
+	size_t nstops = stopped.stopWords(stopRatio, stopDocs);
+	stopped.computeStats();
+
+	std::vector<size_t> sdocs;
+	stopped.wordDocs(sdocs);
+	size_t scount = 0;
+	for (size_t i = 0; i < sdocs.size(); ++i)
+		scount += sdocs[i];
+
+	ivNodeLists stoppedScores;
+	double qstopped = query(stopped, queries, dist, k, repeat, threads, stoppedScores);
+
+	size_t nresults = 0;
+	for (size_t q = 0; q < rawScores.size(); ++q)
+		nresults += rawScores[q].size();
+
+	std::cout << "  stopped: " << nstops << " words, postings " << scount << " ("
+		<< (count ? 100.0 * (count - scount) / count : 0.0) << "% dropped), " << stopped.indexBytes() 
+		<< " bytes, " << qstopped << " s, speedup " << (qstopped > 0 ? qraw / qstopped : 0.0) 
+		<< ", results kept " << common(rawScores, stoppedScores) << " of " << nresults << std::endl;
+
+	return 0;
+}
+catch (std::exception& e)
+{
+	std::cerr << "Error: " << e.what() << std::endl;
+	return 10;
+}
+catch (...)
+{
+	std::cerr << "Something awfull" << std::endl;
+	return 11;
+}
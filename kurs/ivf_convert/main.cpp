@@ -0,0 +1,94 @@
+#include <exception>
+#include <iostream>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+
+#include "ivfile/src/ccInvertedFile.hpp"
+#include "Util/opts.hpp"
+#include "Util/util.hpp"
+
+// Converts an inverted file to the mapped format, that is searched in place
+// instead of read, or with --stream back to the format of ivFile::save.
+// Either one is read. The load times of both files are reported.
+
+void prepare(int argc, char* argv[], std::string& infile, std::string& outfile, bool& stream)
+{
+	bpo::options_description desc("");
+	desc.add_options()
+		("help,h", "Help message")
+		("input,i", bpo::value(&infile)->required(), "Input ivf file")
+		("output,o", bpo::value(&outfile)->required(), "Output ivf file")
+		("stream", bpo::bool_switch(&stream), "Write the stream format instead of the mapped one")
+		;
+
+	bpo::positional_options_description p;
+	p.add("input", 1).add("output", 1);
+
+	bpo::variables_map vm;
+	bpo::store(bpo::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
+	if (vm.count("help"))
+	{
+		std::cout << desc << std::endl;
+		exit(0);
+	}
+
+	bpo::notify(vm);
+}
+
+int main(int argc, char* argv[]) try
+{
+	std::string infile;
+	std::string outfile;
+	bool stream = false;
+
+	prepare(argc, argv, infile, outfile, stream);
+
+	if (!checkFile(infile))
+		throw std::runtime_error(infile + " not found");
+	boost::system::error_code ec;
+	if (boost::filesystem::equivalent(infile, outfile, ec) && !ec)
+		throw std::runtime_error("The output file is the input file");
+
+	Timer timer;
+	timer.tic();
+	ivFile ivf;
+	ivf.load(infile);
+	double tload = timer.toc();
+
+	std::vector<size_t> ndocs;
+	ivf.wordDocs(ndocs);
+	size_t postings = 0;
+	for (size_t i = 0; i < ndocs.size(); ++i)
+		postings += ndocs[i];
+	std::cout << infile << ": " << (ivf.isMapped() ? "mapped" : "stream") << ", words " << ndocs.size()
+		<< ", postings " << postings << ", load " << tload << " s" << std::endl;
+
+	timer.tic();
+	if (stream)
+		ivf.save(outfile);
+	else
+		ivf.saveMapped(outfile);
+	double tsave = timer.toc();
+
+	timer.tic();
+	ivFile out;
+	out.load(outfile);
+	double tout = timer.toc();
+
+	std::cout << outfile << ": " << (out.isMapped() ? "mapped" : "stream") << ", save " << tsave
+		<< " s, load " << tout << " s" << std::endl;
+
+	return 0;
+}
+catch (std::exception& e)
+{
+	std::cerr << "Error: " << e.what() << std::endl;
+	return 10;
+}
+catch (...)
+{
+	std::cerr << "Something awfull" << std::endl;
+	return 11;
+}
@@ -7,7 +7,7 @@
 #include <boost/filesystem/fstream.hpp>
 
 #include "Image/Image.hpp"
-#include "HIKMTree/HIKMTree.hpp"
+#include "HIKMTree/Quantizer.hpp"
 #include "Util/opts.hpp"
 #include "Util/util.hpp"
 #include "ivfile/src/ccInvertedFile.hpp"
@@ -57,7 +57,8 @@ std::istream& operator>>(std::istream& is, ivFile::Weight& wt)
 	return is;
 }
 
-void prepare(int argc, char* argv[], std::string& ofname, std::string& tree_infile, str_vector& word_infiles, ivFile::Params& params) 
+void prepare(int argc, char* argv[], std::string& ofname, std::string& tree_infile, str_vector& word_infiles, ivFile::Params& params,
+	unsigned& threads, double& stopRatio, size_t& stopDocs, bool& mapped) 
 {
 	std::string inlist_file;
 	std::string config;
@@ -70,12 +71,16 @@ void prepare(int argc, char* argv[], std::string& ofname, std::string& tree_infi
 		("list,l", bpo::value(&inlist_file), "File with the list of input sift files")
 		("input,i", bpo::value(&word_infiles), "Words input files")
 		("config,c", bpo::value(&config), "Config file")
+		("mapped", bpo::bool_switch(&mapped), "Write the mapped format, searched in place by query_maker")
 		;
 
 	bpo::options_description optParams("IVF parameters");
 	optParams.add_options()
 		("weight,W", bpo::value(&params.weight), "Weight: none, bin, tf, tfidf")
 		("norm,N", bpo::value(&params.norm), "Norm: none, l0, l1, l2")
+		("threads,j", bpo::value(&threads)->default_value(threads), "Build threads, 0 - one per core")
+		("stop-ratio", bpo::value(&stopRatio)->default_value(stopRatio), "Drop the words in more than this part of the documents")
+		("stop-docs", bpo::value(&stopDocs)->default_value(stopDocs), "Drop the words in more than this many documents, 0 - no limit")
 		;
 
 	desc.add(optParams);
@@ -101,6 +106,9 @@ void prepare(int argc, char* argv[], std::string& ofname, std::string& tree_infi
 
 	bpo::notify(vm);
 
+	if (!(stopRatio > 0 && stopRatio <= 1))
+		throw std::logic_error("--stop-ratio must be in (0, 1]");
+
 	conflicting_options(vm, "input", "list");
 
 	if (vm.count("input"))
@@ -120,7 +128,8 @@ void print_help(char const* pname)
 	std::cout << pname << " ivf_outfile tree_infile word_infile [word_infile ...]" << std::endl;
 }
 
-void readWordInfiles( str_vector &word_infiles, docvec &dv ) 
+// Adds the word files to the inverted file one at a time.
+void readWordInfiles( str_vector &word_infiles, ivFile::Builder &builder ) 
 {
 	TRACE;
 
@@ -133,7 +142,7 @@ void readWordInfiles( str_vector &word_infiles, docvec &dv )
 		Image img("");
 		img.load(inf);
 
-		dv.push_back(img.getWords());
+		builder.addDocument(img.getHist());
 	}
 }
 int main(int argc, char* argv[]) try
@@ -144,24 +153,61 @@ int main(int argc, char* argv[]) try
 	std::string tree_infile;
 	str_vector word_infiles;
 	ivFile::Params params;
+	unsigned threads = 0;
+	double stopRatio = 1;
+	size_t stopDocs = 0;
+	bool mapped = false;
 
-	prepare(argc, argv, ofname, tree_infile, word_infiles, params);
+	prepare(argc, argv, ofname, tree_infile, word_infiles, params, threads, stopRatio, stopDocs, mapped);
 
 	if (!checkFile(tree_infile))
 		throw std::runtime_error(tree_infile + " not found");
 
-	docvec dv;
-
-	readWordInfiles(word_infiles, dv);
+	auto tree = Quantizer::open(tree_infile);
 
-	HIKMTree tree(1,2,3);
-	tree.load(tree_infile);
+	Timer timer;
+	timer.tic();
 
 	ivFile file(params);
-	file.fill(dv, tree.maxWord(), 0);
+	file.setThreads(threads);
+	{
+		ivFile::Builder builder(file, tree->maxWord());
+		readWordInfiles(word_infiles, builder);
+		builder.finish();
+	}
+	double tfill = timer.toc();
+
+	if (stopRatio < 1 || stopDocs)
+	{
+		std::vector<size_t> ndocs;
+		file.wordDocs(ndocs);
+		size_t before = 0;
+		for (size_t i = 0; i < ndocs.size(); ++i)
+			before += ndocs[i];
+		size_t bytes = file.indexBytes();
+
+		size_t nstops = file.stopWords(stopRatio, stopDocs);
+
+		file.wordDocs(ndocs);
+		size_t after = 0;
+		for (size_t i = 0; i < ndocs.size(); ++i)
+			after += ndocs[i];
+		std::cerr << "stop words " << nstops << " of " << ndocs.size() << ", postings " << before 
+			<< " -> " << after << " (" << (before ? 100.0 * (before - after) / before : 0.0) 
+			<< "% dropped), " << bytes << " -> " << file.indexBytes() << " bytes" << std::endl;
+	}
+
 	file.computeStats();
+	double tstats = timer.toc();
+
+	if (mapped)
+		file.saveMapped(ofname);
+	else
+		file.save(ofname);
+	double tsave = timer.toc();
 
-	file.save(ofname);
+	std::cerr << "read and fill " << tfill << " s, stats " << tstats - tfill 
+		<< " s, save " << tsave - tstats << " s" << std::endl;
 
 	return 0;
 }
@@ -0,0 +1,232 @@
+//the SSE2 kernels are compiled for x86, the AVX2 ones where the compiler
+//has the intrinsics. Both are used when the cpu has them
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64)) || \
+	defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <emmintrin.h>
+#define SCORE_SSE2
+#if !defined(_MSC_VER) || _MSC_VER >= 1700
+#include <immintrin.h>
+#define SCORE_AVX2
+#endif
+#endif
+
+#ifdef __GNUC__
+#define AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define AVX2_TARGET
+#endif
+
+#include "ccBlockScore.hpp"
+
+#include "Util/util.hpp"
+
+namespace
+{
+	//ivFile::dist
+	template <ivFile::Dist D>
+	inline float dist1(float a, float b)
+	{
+		switch (D)
+		{
+		case ivFile::DIST_L1:
+			a -= b;
+			return a>0 ? a : -a;
+		case ivFile::DIST_L2:
+			a -= b;
+			return a * a;
+		case ivFile::DIST_HAM:
+			return (float) ((uint)a ^ (uint)b);
+		case ivFile::DIST_COS:
+			return a * b;
+		case ivFile::DIST_JAC:
+			return (a==0 || b==0) ? 0.f : 1.f;
+		case ivFile::DIST_HISTINT:
+			return (a <= b) ? a : b;
+		default:
+			return a;
+		}
+	}
+
+	template <ivFile::Dist D>
+	void scoreScalar(float qval, float qnorm, uint32_t const* docs, float const* vals,
+		size_t n, size_t first, float* scores)
+	{
+		for (size_t j = 0; j < n; ++j)
+		{
+			float& s = scores[docs[j] - first];
+			s -= qnorm + dist1<D>(vals[j], 0);
+			s += dist1<D>(qval, vals[j]);
+		}
+	}
+
+#ifdef SCORE_SSE2
+	//a where m is set, b elsewhere
+	inline __m128 select4(__m128 m, __m128 a, __m128 b)
+	{
+		return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+	}
+
+	//dist1 of 4 lanes
+	template <ivFile::Dist D>
+	inline __m128 dist4(__m128 a, __m128 b)
+	{
+		__m128 const z = _mm_setzero_ps();
+		switch (D)
+		{
+		case ivFile::DIST_L1:
+			a = _mm_sub_ps(a, b);
+			return select4(_mm_cmpgt_ps(a, z), a, _mm_xor_ps(a, _mm_set1_ps(-0.f)));
+		case ivFile::DIST_L2:
+			a = _mm_sub_ps(a, b);
+			return _mm_mul_ps(a, a);
+		case ivFile::DIST_HAM:
+			return _mm_cvtepi32_ps(_mm_xor_si128(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b)));
+		case ivFile::DIST_COS:
+			return _mm_mul_ps(a, b);
+		case ivFile::DIST_JAC:
+			return _mm_andnot_ps(_mm_or_ps(_mm_cmpeq_ps(a, z), _mm_cmpeq_ps(b, z)), _mm_set1_ps(1));
+		case ivFile::DIST_HISTINT:
+			return select4(_mm_cmple_ps(a, b), a, b);
+		default:
+			return a;
+		}
+	}
+
+	template <ivFile::Dist D>
+	void scoreSse2(float qval, float qnorm, uint32_t const* docs, float const* vals,
+		size_t n, size_t first, float* scores)
+	{
+		__m128 const q = _mm_set1_ps(qval);
+		__m128 const qn = _mm_set1_ps(qnorm);
+		__m128 const z = _mm_setzero_ps();
+		size_t j = 0;
+		for (; j + 4 <= n; j += 4)
+		{
+			float* p[4];
+			for (int l = 0; l < 4; ++l)
+				p[l] = scores + (docs[j + l] - first);
+			__m128 s = _mm_setr_ps(*p[0], *p[1], *p[2], *p[3]);
+			__m128 v = _mm_loadu_ps(vals + j);
+
+			s = _mm_sub_ps(s, _mm_add_ps(qn, dist4<D>(v, z)));
+			s = _mm_add_ps(s, dist4<D>(q, v));
+
+			float out[4];
+			_mm_storeu_ps(out, s);
+			for (int l = 0; l < 4; ++l)
+				*p[l] = out[l];
+		}
+		scoreScalar<D>(qval, qnorm, docs + j, vals + j, n - j, first, scores);
+	}
+#endif
+
+#ifdef SCORE_AVX2
+	//dist1 of 8 lanes
+	template <ivFile::Dist D>
+	AVX2_TARGET inline __m256 dist8(__m256 a, __m256 b)
+	{
+		__m256 const z = _mm256_setzero_ps();
+		switch (D)
+		{
+		case ivFile::DIST_L1:
+			a = _mm256_sub_ps(a, b);
+			return _mm256_blendv_ps(_mm256_xor_ps(a, _mm256_set1_ps(-0.f)), a, _mm256_cmp_ps(a, z, _CMP_GT_OQ));
+		case ivFile::DIST_L2:
+			a = _mm256_sub_ps(a, b);
+			return _mm256_mul_ps(a, a);
+		case ivFile::DIST_HAM:
+			return _mm256_cvtepi32_ps(_mm256_xor_si256(_mm256_cvttps_epi32(a), _mm256_cvttps_epi32(b)));
+		case ivFile::DIST_COS:
+			return _mm256_mul_ps(a, b);
+		case ivFile::DIST_JAC:
+			return _mm256_andnot_ps(_mm256_or_ps(_mm256_cmp_ps(a, z, _CMP_EQ_OQ), _mm256_cmp_ps(b, z, _CMP_EQ_OQ)),
+				_mm256_set1_ps(1));
+		case ivFile::DIST_HISTINT:
+			return _mm256_blendv_ps(b, a, _mm256_cmp_ps(a, b, _CMP_LE_OQ));
+		default:
+			return a;
+		}
+	}
+
+	template <ivFile::Dist D>
+	AVX2_TARGET void scoreAvx2(float qval, float qnorm, uint32_t const* docs, float const* vals,
+		size_t n, size_t first, float* scores)
+	{
+		__m256 const q = _mm256_set1_ps(qval);
+		__m256 const qn = _mm256_set1_ps(qnorm);
+		__m256 const z = _mm256_setzero_ps();
+		__m256i const base = _mm256_set1_epi32((int)first);
+		size_t j = 0;
+		for (; j + 8 <= n; j += 8)
+		{
+			__m256i idx = _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<__m256i const*>(docs + j)), base);
+			__m256 s = _mm256_i32gather_ps(scores, idx, 4);
+			__m256 v = _mm256_loadu_ps(vals + j);
+
+			s = _mm256_sub_ps(s, _mm256_add_ps(qn, dist8<D>(v, z)));
+			s = _mm256_add_ps(s, dist8<D>(q, v));
+
+			//no scatter in AVX2
+			float out[8];
+			int at[8];
+			_mm256_storeu_ps(out, s);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(at), idx);
+			for (int l = 0; l < 8; ++l)
+				scores[at[l]] = out[l];
+		}
+		scoreScalar<D>(qval, qnorm, docs + j, vals + j, n - j, first, scores);
+	}
+#endif
+
+	//kernels by instruction set and distance
+	ivBlockScore::Kernel const kernels[ivBlockScore::ISA_LAST][ivFile::DIST_LAST] =
+	{
+		{
+			&scoreScalar<ivFile::DIST_L1>, &scoreScalar<ivFile::DIST_L2>, &scoreScalar<ivFile::DIST_HAM>,
+			&scoreScalar<ivFile::DIST_KL>, &scoreScalar<ivFile::DIST_COS>, &scoreScalar<ivFile::DIST_JAC>,
+			&scoreScalar<ivFile::DIST_HISTINT>
+		},
+#ifdef SCORE_SSE2
+		{
+			&scoreSse2<ivFile::DIST_L1>, &scoreSse2<ivFile::DIST_L2>, &scoreSse2<ivFile::DIST_HAM>,
+			&scoreSse2<ivFile::DIST_KL>, &scoreSse2<ivFile::DIST_COS>, &scoreSse2<ivFile::DIST_JAC>,
+			&scoreSse2<ivFile::DIST_HISTINT>
+		},
+#else
+		{},
+#endif
+#ifdef SCORE_AVX2
+		{
+			&scoreAvx2<ivFile::DIST_L1>, &scoreAvx2<ivFile::DIST_L2>, &scoreAvx2<ivFile::DIST_HAM>,
+			&scoreAvx2<ivFile::DIST_KL>, &scoreAvx2<ivFile::DIST_COS>, &scoreAvx2<ivFile::DIST_JAC>,
+			&scoreAvx2<ivFile::DIST_HISTINT>
+		},
+#else
+		{},
+#endif
+	};
+}
+
+//------------------------------------------------------------------------
+ivBlockScore::Kernel ivBlockScore::kernel(ivFile::Dist dist, Isa isa)
+{
+	if (dist < 0 || dist >= ivFile::DIST_LAST || isa < 0 || isa >= ISA_LAST)
+		return 0;
+	if (isa == ISA_AVX2 && !cpuFeatures().avx2)
+		return 0;
+	return kernels[isa][dist];
+}
+
+ivBlockScore::Isa ivBlockScore::best()
+{
+	for (int isa = ISA_LAST - 1; isa > ISA_SCALAR; --isa)
+		if (kernel(ivFile::DIST_L1, (Isa)isa))
+			return (Isa)isa;
+	return ISA_SCALAR;
+}
+
+char const* ivBlockScore::name(Isa isa)
+{
+	char const* const names[ISA_LAST] = {"scalar", "sse2", "avx2"};
+	return isa >= 0 && isa < ISA_LAST ? names[isa] : "";
+}
@@ -0,0 +1,42 @@
+#ifndef CC_BLOCKSCORE
+#define CC_BLOCKSCORE
+
+#include <cstddef>
+#include <stdint.h>
+
+#include "ccInvertedFile.hpp"
+
+//------------------------------------------------------------------------
+//Adds the document entries of a query word to the scores of the documents.
+//For every entry j, with d = docs[j] - first
+//  scores[d] -= qnorm + dist(vals[j], 0);
+//  scores[d] += dist(qval, vals[j]);
+//with the float operations of ivFile::dist, a SIMD register of entries at
+//a time: the scores are gathered, updated and written back lane by lane.
+//The documents of a word are distinct, so no two lanes hold the same
+//score. ham takes values below 2^31
+class ivBlockScore
+{
+public:
+	enum Isa
+	{
+		ISA_SCALAR,
+		ISA_SSE2,
+		ISA_AVX2,
+		ISA_LAST
+	};
+
+	typedef void (*Kernel)(float qval, float qnorm, uint32_t const* docs, float const* vals,
+		size_t n, size_t first, float* scores);
+
+	//the kernel of a distance for an instruction set, nullptr if the cpu
+	//or the compiler doesn't have it
+	static Kernel kernel(ivFile::Dist dist, Isa isa);
+
+	//the widest instruction set of the cpu
+	static Isa best();
+
+	static char const* name(Isa isa);
+};
+
+#endif
@@ -0,0 +1,89 @@
+#include <algorithm>
+#include <cmath>
+
+#include "ccImpactPostings.hpp"
+#include "ccInvertedFile.hpp"
+
+//------------------------------------------------------------------------
+void ivImpacts::build(ivPostings const& ps)
+{
+	clear();
+
+	//one step for all the words, the largest value gets the top impact
+	float top = 0;
+	for (size_t j = 0; j < ps.vals.size(); ++j)
+		top = max(top, ps.vals[j]);
+	step = top > 0 ? top / LEVELS : 0;
+
+	size_t nw = ps.size();
+	woffs.resize(nw + 1);
+	docs.resize(ps.docs.size());
+
+	vector<uint8_t> impacts;
+	for (size_t i = 0; i < nw; ++i)
+	{
+		woffs[i] = segs.size();
+		size_t b = ps.begin(i), e = ps.end(i);
+
+		//impacts of the entries, documents with a value keep at least 1
+		size_t count[LEVELS + 1] = {0};
+		impacts.resize(e - b);
+		for (size_t j = b; j < e; ++j)
+		{
+			float v = ps.vals[j];
+			uint8_t q = 0;
+			if (v > 0)
+				q = (uint8_t)max(1.f, min(floor(v / step + 0.5f), (float)LEVELS));
+			impacts[j - b] = q;
+			++count[q];
+		}
+
+		//a segment for every impact the word has, the largest first. The
+		//entries are placed in document order, so every segment is sorted
+		size_t pos[LEVELS + 1];
+		size_t o = b;
+		for (int q = LEVELS; q >= 0; --q)
+		{
+			pos[q] = o;
+			if (!count[q])
+				continue;
+			Segment seg;
+			seg.impact = (uint8_t)q;
+			seg.first = o;
+			segs.push_back(seg);
+			o += count[q];
+		}
+		for (size_t j = b; j < e; ++j)
+			docs[pos[impacts[j - b]]++] = ps.docs[j];
+	}
+	woffs[nw] = segs.size();
+
+	//the end of the last segment
+	Segment end;
+	end.impact = 0;
+	end.first = docs.size();
+	segs.push_back(end);
+}
+
+//------------------------------------------------------------------------
+size_t ivImpacts::bytes() const
+{
+	return woffs.size() * sizeof(woffs[0]) + segs.size() * sizeof(Segment) +
+		docs.size() * sizeof(docs[0]);
+}
+
+void ivImpacts::clear()
+{
+	woffs.clear();
+	segs.clear();
+	docs.clear();
+	step = 0;
+}
+
+void ivImpacts::swap(ivImpacts& other)
+{
+	woffs.swap(other.woffs);
+	segs.swap(other.segs);
+	docs.swap(other.docs);
+	std::swap(step, other.step);
+}
@@ -0,0 +1,66 @@
+#ifndef CC_IMPACTPOSTINGS
+#define CC_IMPACTPOSTINGS
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+class ivPostings;
+
+//------------------------------------------------------------------------
+//Document entries of all the words ordered by impact. The values are
+//quantized to 8 bits with one step for the whole file, so the impacts of
+//all the words compare. The entries of a word are cut into segments of the
+//same impact, largest first, the documents of a segment ascending. Counts
+//are not kept
+class ivImpacts
+{
+public:
+	static const unsigned LEVELS = 255;
+
+	struct Segment
+	{
+		//quantized value of the entries
+		uint8_t impact;
+		//first entry of the segment in docs, the next segment starts where
+		//it ends
+		size_t first;
+	};
+
+	//first segment of every word and the total
+	vector<size_t> woffs;
+	//segments of all the words and one past the last
+	vector<Segment> segs;
+	vector<uint32_t> docs;
+	//value of impact 1
+	float step;
+
+	ivImpacts() : step(0) {}
+
+	//number of words
+	size_t size() const { return woffs.empty() ? 0 : woffs.size() - 1; }
+
+	//segments of word i, none for words past the end
+	size_t begin(size_t i) const { return i < size() ? woffs[i] : size() ? woffs.back() : 0; }
+	size_t end(size_t i) const { return i < size() ? woffs[i + 1] : size() ? woffs.back() : 0; }
+
+	//entries of segment s
+	size_t first(size_t s) const { return segs[s].first; }
+	size_t last(size_t s) const { return segs[s + 1].first; }
+
+	//value of an impact
+	float value(uint8_t impact) const { return impact * step; }
+
+	//quantize and order the postings. The values must not be negative
+	void build(ivPostings const& ps);
+
+	//memory of the entries
+	size_t bytes() const;
+
+	void clear();
+	void swap(ivImpacts& other);
+};
+
+#endif
@@ -1,66 +1,277 @@
 #include <algorithm>
 #include <cassert>
+#include <cfloat>
 #include <cmath>
+#include <cstring>
 #include <exception>
 #include <fstream>
 #include <string>
 #include <iterator>
 
 #include "ccInvertedFile.hpp"
+#include "ccBlockScore.hpp"
 
+#include "Util/threads.hpp"
 #include "Util/util.hpp"
 
 #include "vc_fix.hpp"
 
+namespace
+{
+	//tag of the stop words section that follows the postings
+	char const STOP_MAGIC[8] = {'I', 'V', 'S', 'T', 'O', 'P', '0', '1'};
+
+	//the mapped format: a header, then the sections at the offsets it has,
+	//every one aligned to MAP_ALIGN. The sizes are 64 bits, the byte order
+	//is the one of the machine that wrote it
+	char const MAP_MAGIC[8] = {'I', 'V', 'F', 'I', 'L', 'E', '0', '2'};
+	uint64_t const MAP_ALIGN = 64;
+
+	enum MapSection
+	{
+		MAP_DOCS,    // uint64 tokens of every document
+		MAP_WORDS,   // MapWord of every word
+		MAP_OFFS,    // uint64 first entry of every word and the total
+		MAP_DOCIDS,  // uint32 document of every entry
+		MAP_VALS,    // float value of every entry
+		MAP_COUNTS,  // uint32 count of every entry
+		MAP_LAST
+	};
+
+	struct MapHeader
+	{
+		char magic[8];
+		//1 in the byte order of the file
+		uint32_t order;
+		uint32_t norm;
+		uint32_t weight;
+		uint32_t pad;
+		uint64_t ndocs;
+		uint64_t nwords;
+		uint64_t npostings;
+		//offset of every section
+		uint64_t sections[MAP_LAST];
+	};
+
+	struct MapWord
+	{
+		uint64_t ndocs;
+		uint64_t wf;
+		float maxval;
+		float minval;
+		uint32_t stop;
+		uint32_t pad;
+	};
+
+	//bytes of the sections of a file
+	void mapBytes(MapHeader const& h, uint64_t bytes[MAP_LAST])
+	{
+		bytes[MAP_DOCS] = h.ndocs * sizeof(uint64_t);
+		bytes[MAP_WORDS] = h.nwords * sizeof(MapWord);
+		bytes[MAP_OFFS] = (h.nwords + 1) * sizeof(uint64_t);
+		bytes[MAP_DOCIDS] = h.npostings * sizeof(uint32_t);
+		bytes[MAP_VALS] = h.npostings * sizeof(float);
+		bytes[MAP_COUNTS] = h.npostings * sizeof(uint32_t);
+	}
+
+	//first item of part i when n items are cut into parts
+	size_t partBegin(size_t n, size_t parts, size_t i)
+	{
+		return n * i / parts;
+	}
+
+	//a count of the postings, throws when it doesn't fit
+	uint32_t checkCount(size_t count)
+	{
+		if (count > ivPostings::MAX_COUNT)
+			throw std::runtime_error("Count too large for the inverted file");
+		return (uint32_t)count;
+	}
+
+	//counting sort helper: turns the counts of every key in every part into
+	//the position the part writes its next item of the key at, so that the
+	//items are grouped by key and keep the order of the parts. offs gets
+	//the first item of every key and the total
+	void partOffsets(ThreadPool& pool, vector<vector<uint> >& cnt, vector<size_t>& offs)
+	{
+		size_t nkeys = offs.size() - 1;
+
+		parallelFor(pool, 0, nkeys, 4096, [&](size_t b, size_t e)
+		{
+			for (size_t k = b; k < e; ++k)
+			{
+				size_t total = 0;
+				for (size_t p = 0; p < cnt.size(); ++p)
+					total += cnt[p][k];
+				offs[k + 1] = total;
+			}
+		});
+
+		offs[0] = 0;
+		for (size_t k = 0; k < nkeys; ++k)
+			offs[k + 1] += offs[k];
+		if (offs[nkeys] > (uint)-1)
+			throw std::runtime_error("Too many postings for the inverted file");
+
+		parallelFor(pool, 0, nkeys, 4096, [&](size_t b, size_t e)
+		{
+			for (size_t k = b; k < e; ++k)
+			{
+				size_t pos = offs[k];
+				for (size_t p = 0; p < cnt.size(); ++p)
+				{
+					uint c = cnt[p][k];
+					cnt[p][k] = (uint)pos;
+					pos += c;
+				}
+			}
+		});
+	}
+
+	//cursor on the entries of a word in the documents first -> last-1, raw
+	//or compressed
+	class Cursor
+	{
+	public:
+		Cursor(ivPostings const& ps, ivPacked const& pk, bool packed, size_t wid, 
+			size_t first, size_t last) :
+			ps(ps),
+			pk(pk),
+			packed(packed),
+			last((uint32_t)min<size_t>(last, 0xFFFFFFFFu)),
+			pos(0),
+			n(0),
+			b(0),
+			bend(0)
+		{
+			if (packed)
+			{
+				b = pk.begin(wid);
+				bend = pk.end(wid);
+				if (b < bend)
+					n = pk.decode(b, docs, vals);
+			}
+			else
+			{
+				uint32_t const* db = ps.docs.begin();
+				pos = lower_bound(db + ps.begin(wid), db + ps.end(wid), (uint32_t)first) - db;
+				n = ps.end(wid);
+			}
+			seek((uint32_t)first);
+		}
+
+		bool done() const { return pos >= n || doc() >= last; }
+		uint32_t doc() const { return packed ? docs[pos] : ps.docs[pos]; }
+		float val() const { return packed ? vals[pos] : ps.vals[pos]; }
+
+		void next()
+		{
+			if (++pos >= n && packed && b + 1 < bend)
+			{
+				n = pk.decode(++b, docs, vals);
+				pos = 0;
+			}
+		}
+
+		//move to the first entry of a document >= d
+		void seek(uint32_t d)
+		{
+			if (packed)
+			{
+				//skip the blocks that end before d without decoding them
+				size_t nb = b;
+				while (nb + 1 < bend && pk.blocks[nb + 1].base < d) ++nb;
+				if (nb != b)
+				{
+					b = nb;
+					n = pk.decode(b, docs, vals);
+					pos = 0;
+				}
+				while (pos < n && docs[pos] < d) next();
+			}
+			else if (pos < n && ps.docs[pos] < d)
+			{
+				uint32_t const* db = ps.docs.begin();
+				pos = lower_bound(db + pos, db + n, d) - db;
+			}
+		}
+
+	private:
+		ivPostings const& ps;
+		ivPacked const& pk;
+		bool packed;
+		uint32_t last;
+
+		//raw: the entry and the end of the word, compressed: the entry and 
+		//the size of the decoded block b
+		size_t pos, n;
+		size_t b, bend;
+		uint32_t docs[ivPacked::BLOCK];
+		float vals[ivPacked::BLOCK];
+	};
+}
+
 
 //------------------------------------------------------------------------
 void ivFile::fill(wordtype* wlabel, wordtype* dlabel, size_t ntokens, 
 	size_t nwords, size_t ndocs)
 {
+	this->checkRaw();
+	this->unmap();
+
 	//allocate vectors
 	words.resize(nwords);
 	docs.resize(ndocs);
 
-	//now loop on the tokens and fill in the hdata
+	//count the valid tokens of every word and document
+	vector<size_t> woffs(nwords + 1, 0), doffs(ndocs + 1, 0);
 	for (size_t i = 0; i < ntokens; ++i)
 	{
-		//get the labels
 		if (wlabel[i] == 0 || (size_t)wlabel[i]>nwords || 
 			dlabel[i]==0 || (size_t)dlabel[i]>ndocs)
 		{
 			continue;
 		}
+		woffs[wlabel[i]]++;
+		doffs[dlabel[i]]++;
+	}
+	for (size_t i = 0; i < nwords; ++i)
+		woffs[i + 1] += woffs[i];
+	for (size_t i = 0; i < ndocs; ++i)
+	{
+		docs[i].ntokens += doffs[i + 1];
+		doffs[i + 1] += doffs[i];
+	}
 
-		uint wl = (uint)wlabel[i]-1;
-		uint dl = (uint)dlabel[i]-1;
-
-		//get word
-		ivWord* w = &words[wl];        
-
-		//increment word count
-		w->wf++;    
-
-		//make a new wordDoc
-		ivWordDoc newdoc;
-		newdoc.doc = dl;
-
-		//find position of this document id in the list
-		ivWordDocIt wdit = lower_bound (w->docs.begin(), w->docs.end(), newdoc); 
-
-		//check if not found, then add it in the correct place
-		if (wdit == w->docs.end() || newdoc<(*wdit))
+	//radix sort: the words of the tokens by document, then the documents
+	//by word. Both passes are stable, so the documents of a word ascend
+	vector<uint> bydoc(doffs[ndocs]);
+	{
+		vector<size_t> pos(doffs.begin(), doffs.end() - 1);
+		for (size_t i = 0; i < ntokens; ++i)
 		{
-			wdit = w->docs.insert(wdit, newdoc);
-			w->ndocs++;
+			if (wlabel[i] == 0 || (size_t)wlabel[i]>nwords || 
+				dlabel[i]==0 || (size_t)dlabel[i]>ndocs)
+			{
+				continue;
+			}
+			bydoc[pos[dlabel[i] - 1]++] = wlabel[i] - 1;
 		}
+	}
 
-		//increment word count for this word's doc
-		wdit->count++;
-
-		//increment document count of tokens
-		docs[dl].ntokens++;
+	vector<uint> sorted(bydoc.size());
+	{
+		vector<size_t> pos(woffs.begin(), woffs.end() - 1);
+		for (size_t d = 0; d < ndocs; ++d)
+			for (size_t j = doffs[d]; j < doffs[d + 1]; ++j)
+				sorted[pos[bydoc[j]]++] = d;
 	}
 
+	ThreadPool pool(this->nthreads);
+	vector<ivPostings> runs(1);
+	makeRun(pool, woffs, sorted, nullptr, runs[0]);
+	addRuns(pool, runs);
+
 	//put sizes
 	this->nwords = nwords;
 	this->ndocs = ndocs;
@@ -73,68 +284,509 @@ void ivFile::fill(wordtype* wlabel, wordtype* dlabel, size_t ntokens,
 void ivFile::fill(docvec const& data, uint nwords, uint idshift)
 {
 	cout << __FUNCTION__ << endl;
-	//number of documents
-	size_t ndocs = data.size();
+	this->checkRaw();
+	this->unmap();
+
+	ThreadPool pool(this->nthreads);
+	Timer timer;
+	timer.tic();
 
 	//allocate vectors
 	words.resize(nwords);
-	docs.resize(ndocs);
+	if (docs.size() < idshift + data.size())
+		docs.resize(idshift + data.size());
 
-	//loop on the documents and fill in
-	for (size_t d = 0; d < ndocs; ++d)
+	//count the tokens of every word in ranges of documents
+	size_t const parts = max<size_t>(1, min<size_t>(pool.size(), data.size()));
+	vector<vector<uint> > cnt(parts, vector<uint>(nwords, 0));
+	parallelFor(pool, 0, parts, 1, [&](size_t pb, size_t pe)
 	{
-		//cout << "doc:" << d << endl;
-		//get the document data
-		const wordvec& doc = data[d];
-		//document label
-		uint dl = d + idshift;
+		for (size_t p = pb; p < pe; ++p)
+		{
+			vector<uint>& c = cnt[p];
+			for (size_t d = partBegin(data.size(), parts, p), dend = partBegin(data.size(), parts, p + 1); 
+				d < dend; ++d)
+			{
+				const wordvec& doc = data[d];
+
+				//update ntokens for this document
+				docs[d + idshift].ntokens += doc.size();
 
-		//update ntokens for this document
-		docs[dl].ntokens += doc.size();
+				for (size_t t = 0; t < doc.size(); ++t)
+					if (doc[t] != 0 && (uint)doc[t] <= nwords)
+						c[doc[t] - 1]++;
+			}
+		}
+	});
+
+	vector<size_t> woffs(nwords + 1);
+	partOffsets(pool, cnt, woffs);
+	double tcount = timer.toc();
 
-		//loop and update
-		for (size_t t=0; t < doc.size(); ++t)
+	//counting sort of the tokens by word, the documents come in order
+	vector<uint> sorted(woffs[nwords]);
+	parallelFor(pool, 0, parts, 1, [&](size_t pb, size_t pe)
+	{
+		for (size_t p = pb; p < pe; ++p)
 		{
-			//word label
-			if ((uint)doc[t] > nwords)
-				continue;
+			vector<uint>& pos = cnt[p];
+			for (size_t d = partBegin(data.size(), parts, p), dend = partBegin(data.size(), parts, p + 1); 
+				d < dend; ++d)
+			{
+				const wordvec& doc = data[d];
+				for (size_t t = 0; t < doc.size(); ++t)
+					if (doc[t] != 0 && (uint)doc[t] <= nwords)
+						sorted[pos[doc[t] - 1]++] = d + idshift;
+			}
+		}
+	});
+	cnt.clear();
+	double tsort = timer.toc();
 
-			if (doc[t] == 0)
-				continue;
+	vector<ivPostings> runs(1);
+	makeRun(pool, woffs, sorted, nullptr, runs[0]);
+	sorted.clear();
+	addRuns(pool, runs);
+	double tpost = timer.toc();
 
-			uint wl = (uint)(doc[t]-1);
+	cout << __FUNCTION__ << ": count " << tcount << " s, sort " << tsort - tcount 
+		<< " s, postings " << tpost - tsort << " s, threads " << pool.size() << endl;
 
-			//get word
-			ivWord* w = &words[wl];        
+	//put sizes
+	this->nwords = nwords;
+	this->ndocs = docs.size();
+}
 
-			//increment word count
-			w->wf++;    
+//------------------------------------------------------------------------
+void ivPostings::resize(size_t nentries)
+{
+	docs.resize(nentries);
+	counts.resize(nentries);
+	vals.resize(nentries);
+}
+
+void ivPostings::detach()
+{
+	offs.detach();
+	docs.detach();
+	counts.detach();
+	vals.detach();
+}
+
+void ivPostings::clear()
+{
+	offs.clear();
+	docs.clear();
+	counts.clear();
+	vals.clear();
+}
+
+void ivPostings::swap(ivPostings& other)
+{
+	offs.swap(other.offs);
+	docs.swap(other.docs);
+	counts.swap(other.counts);
+	vals.swap(other.vals);
+}
 
-			//make a new wordDoc
-			ivWordDoc newdoc;
-			newdoc.doc = dl;
+//------------------------------------------------------------------------
+void ivFile::makeRun(ThreadPool& pool, vector<size_t> const& woffs, 
+	vector<uint> const& sorted, vector<uint> const* counts, ivPostings& run)
+{
+	size_t nw = woffs.size() - 1;
 
-			//find position of this document id in the list
-			//cout << "wordid " << wl << " size" <<  w->docs.size() << endl;
-			ivWordDocIt wdit = lower_bound (w->docs.begin(), w->docs.end(), newdoc); 
+	//one entry per run of equal documents
+	run.offs.assign(nw + 1, 0);
+	parallelFor(pool, 0, nw, 1024, [&](size_t b, size_t e)
+	{
+		for (size_t i = b; i < e; ++i)
+		{
+			size_t n = 0;
+			for (size_t j = woffs[i]; j < woffs[i + 1]; ++j)
+				n += j == woffs[i] || sorted[j] != sorted[j - 1];
+			run.offs[i + 1] = n;
+		}
+	});
+	for (size_t i = 0; i < nw; ++i)
+		run.offs[i + 1] += run.offs[i];
+	run.resize(run.offs[nw]);
 
-			//check if not found, then add it in the correct place
-			if (wdit == w->docs.end() || newdoc<(*wdit))
+	//the words are independent
+	parallelFor(pool, 0, nw, 1024, [&](size_t b, size_t e)
+	{
+		for (size_t i = b; i < e; ++i)
+		{
+			size_t o = run.offs[i];
+			for (size_t j = woffs[i], jend = woffs[i + 1]; j < jend; ++o)
 			{
-				wdit = w->docs.insert(wdit, newdoc);
-				w->ndocs++;
+				uint doc = sorted[j];
+				size_t count = 0;
+				for (; j < jend && sorted[j] == doc; ++j)
+					count += counts ? (*counts)[j] : 1;
+
+				run.docs[o] = doc;
+				run.counts[o] = checkCount(count);
+				run.vals[o] = 0;
+				words[i].wf += count;
 			}
+		}
+	});
+}
+
+//------------------------------------------------------------------------
+void ivFile::addRuns(ThreadPool& pool, vector<ivPostings>& runs)
+{
+	size_t nw = this->words.size();
+
+	//the postings the file has go first
+	if (!postings.docs.empty())
+	{
+		runs.insert(runs.begin(), ivPostings());
+		runs.front().swap(postings);
+	}
+
+	ivPostings out;
+	if (runs.size() == 1 && runs[0].size() == nw)
+	{
+		out.swap(runs[0]);
+	}
+	else
+	{
+		//a word whose documents overlap between the runs is merged, the
+		//others are copied run after run
+		vector<char> overlap(nw, 0);
+		out.offs.assign(nw + 1, 0);
+		parallelFor(pool, 0, nw, 1024, [&](size_t b, size_t e)
+		{
+			vector<uint32_t> all;
+			for (size_t i = b; i < e; ++i)
+			{
+				size_t n = 0;
+				long long last = -1;
+				for (size_t r = 0; r < runs.size(); ++r)
+				{
+					size_t rb = runs[r].begin(i), re = runs[r].end(i);
+					if (rb == re)
+						continue;
+					if ((long long)runs[r].docs[rb] <= last)
+						overlap[i] = 1;
+					last = runs[r].docs[re - 1];
+					n += re - rb;
+				}
+
+				if (overlap[i])
+				{
+					all.clear();
+					for (size_t r = 0; r < runs.size(); ++r)
+						all.insert(all.end(), runs[r].docs.begin() + runs[r].begin(i), 
+							runs[r].docs.begin() + runs[r].end(i));
+					sort(all.begin(), all.end());
+					n = unique(all.begin(), all.end()) - all.begin();
+				}
+				out.offs[i + 1] = n;
+			}
+		});
+		for (size_t i = 0; i < nw; ++i)
+			out.offs[i + 1] += out.offs[i];
+		out.resize(out.offs[nw]);
+
+		parallelFor(pool, 0, nw, 1024, [&](size_t b, size_t e)
+		{
+			vector<pair<uint32_t, size_t> > all;
+			for (size_t i = b; i < e; ++i)
+			{
+				size_t o = out.offs[i];
+				if (!overlap[i])
+				{
+					for (size_t r = 0; r < runs.size(); ++r)
+						for (size_t j = runs[r].begin(i), jend = runs[r].end(i); j < jend; ++j, ++o)
+						{
+							out.docs[o] = runs[r].docs[j];
+							out.counts[o] = runs[r].counts[j];
+							out.vals[o] = runs[r].vals[j];
+						}
+					continue;
+				}
+
+				//equal documents add up their counts
+				all.clear();
+				for (size_t r = 0; r < runs.size(); ++r)
+					for (size_t j = runs[r].begin(i), jend = runs[r].end(i); j < jend; ++j)
+						all.push_back(make_pair(runs[r].docs[j], (size_t)runs[r].counts[j]));
+				stable_sort(all.begin(), all.end());
+				for (size_t j = 0; j < all.size(); ++o)
+				{
+					uint32_t doc = all[j].first;
+					size_t count = 0;
+					for (; j < all.size() && all[j].first == doc; ++j)
+						count += all[j].second;
+					out.docs[o] = doc;
+					out.counts[o] = checkCount(count);
+					out.vals[o] = 0;
+				}
+			}
+		});
+	}
+	runs.clear();
+
+	postings.swap(out);
+	for (size_t i = 0; i < nw; ++i)
+		this->words[i].ndocs = postings.end(i) - postings.begin(i);
+}
+
+//------------------------------------------------------------------------
+void ivFile::fill(histvec const& data, uint nwords, uint idshift)
+{
+	cout << __FUNCTION__ << endl;
+	this->checkRaw();
+	this->unmap();
 
-			//increment word count for this word's doc
-			wdit->count++;
+	ThreadPool pool(this->nthreads);
+	double times[3];
+	vector<ivPostings> runs(1);
+	makeHistRun(pool, data, nwords, idshift, runs[0], times);
+	addRuns(pool, runs);
+
+	cout << __FUNCTION__ << ": count " << times[0] << " s, sort " << times[1] 
+		<< " s, postings " << times[2] << " s, threads " << pool.size() << endl;
+}
+
+//------------------------------------------------------------------------
+void ivFile::makeHistRun(ThreadPool& pool, histvec const& data, uint nwords, uint idshift, 
+	ivPostings& run, double* times)
+{
+	Timer timer;
+	timer.tic();
+
+	//allocate vectors
+	words.resize(nwords);
+	if (docs.size() < idshift + data.size())
+		docs.resize(idshift + data.size());
+
+	//count the documents of every word in ranges of documents
+	size_t const parts = max<size_t>(1, min<size_t>(pool.size(), data.size()));
+	vector<vector<uint> > cnt(parts, vector<uint>(nwords, 0));
+	parallelFor(pool, 0, parts, 1, [&](size_t pb, size_t pe)
+	{
+		for (size_t p = pb; p < pe; ++p)
+		{
+			vector<uint>& c = cnt[p];
+			for (size_t d = partBegin(data.size(), parts, p), dend = partBegin(data.size(), parts, p + 1); 
+				d < dend; ++d)
+			{
+				const WordHist& hist = data[d];
+				for (size_t t = 0; t < hist.size(); ++t)
+				{
+					//tokens of invalid words count as well
+					docs[d + idshift].ntokens += hist[t].count;
+
+					if (hist[t].word != 0 && hist[t].word <= nwords)
+						c[hist[t].word - 1]++;
+				}
+			}
 		}
+	});
+
+	vector<size_t> woffs(nwords + 1);
+	partOffsets(pool, cnt, woffs);
+	double tcount = timer.toc();
+
+	//every word appears once per document, so the sorted documents come
+	//with their counts
+	vector<uint> sorted(woffs[nwords]), counts(woffs[nwords]);
+	parallelFor(pool, 0, parts, 1, [&](size_t pb, size_t pe)
+	{
+		for (size_t p = pb; p < pe; ++p)
+		{
+			vector<uint>& pos = cnt[p];
+			for (size_t d = partBegin(data.size(), parts, p), dend = partBegin(data.size(), parts, p + 1); 
+				d < dend; ++d)
+			{
+				const WordHist& hist = data[d];
+				for (size_t t = 0; t < hist.size(); ++t)
+				{
+					if (hist[t].word == 0 || hist[t].word > nwords)
+						continue;
+					uint i = pos[hist[t].word - 1]++;
+					sorted[i] = d + idshift;
+					counts[i] = hist[t].count;
+				}
+			}
+		}
+	});
+	cnt.clear();
+	double tsort = timer.toc();
+
+	makeRun(pool, woffs, sorted, &counts, run);
+	double tpost = timer.toc();
+
+	if (times)
+	{
+		times[0] = tcount;
+		times[1] = tsort - tcount;
+		times[2] = tpost - tsort;
 	}
 
 	//put sizes
 	this->nwords = nwords;
-	this->ndocs = ndocs;  
+	this->ndocs = docs.size();
 }
 
+//------------------------------------------------------------------------
+ivFile::Builder::Builder(ivFile& ivf, uint nwords, size_t batch) :
+	ivf(ivf),
+	nwords(nwords),
+	batch(max<size_t>(batch, 1)),
+	npostings(0),
+	idshift(ivf.docs.size()),
+	pool(new ThreadPool(ivf.nthreads))
+{
+	ivf.checkRaw();
+	ivf.unmap();
+	for (int i = 0; i < 3; ++i)
+		times[i] = 0;
+	ivf.words.resize(nwords);
+}
+
+ivFile::Builder::~Builder()
+{
+}
+
+//------------------------------------------------------------------------
+void ivFile::Builder::addDocument(const Word* words, size_t ntokens)
+{
+	//the histogram of the tokens
+	tokens.assign(words, words + ntokens);
+	sort(tokens.begin(), tokens.end());
+
+	WordHist hist;
+	for (size_t i = 0; i < tokens.size(); )
+	{
+		size_t j = i;
+		while (j < tokens.size() && tokens[j] == tokens[i])
+			++j;
+		WordCount wc = { tokens[i], (uint32_t)(j - i) };
+		hist.push_back(wc);
+		i = j;
+	}
+
+	add(hist);
+}
+
+void ivFile::Builder::addDocument(WordHist const& hist)
+{
+	WordHist copy(hist);
+	add(copy);
+}
+
+void ivFile::Builder::add(WordHist& hist)
+{
+	npostings += hist.size();
+	pending.push_back(WordHist());
+	pending.back().swap(hist);
+
+	if (npostings >= batch || pending.size() >= batch)
+		flush();
+}
+
+//------------------------------------------------------------------------
+void ivFile::Builder::flush()
+{
+	if (pending.empty())
+		return;
+
+	double t[3];
+	ivPostings ps;
+	ivf.makeHistRun(*pool, pending, nwords, idshift, ps, t);
+	for (int i = 0; i < 3; ++i)
+		times[i] += t[i];
+
+	//keep the offsets of the words the batch has, not of all the words
+	runs.push_back(Run());
+	Run& run = runs.back();
+	for (size_t i = 0; i < ps.size(); ++i)
+		if (ps.end(i) > ps.begin(i))
+		{
+			run.wids.push_back((uint32_t)i);
+			run.offs.push_back(ps.begin(i));
+		}
+	run.offs.push_back(ps.docs.size());
+	run.docs.assign(ps.docs.begin(), ps.docs.end());
+	run.counts.assign(ps.counts.begin(), ps.counts.end());
+
+	idshift += pending.size();
+	pending.clear();
+	npostings = 0;
+}
+
+//------------------------------------------------------------------------
+void ivFile::Builder::finish()
+{
+	flush();
+
+	//the batches follow each other and the documents of the file, so the
+	//lists of a word are concatenated
+	Timer timer;
+	timer.tic();
+	ivPostings& ps = ivf.postings;
+	size_t nw = ivf.words.size();
+
+	ivPostings out;
+	out.offs.assign(nw + 1, 0);
+	for (size_t i = 0; i < nw; ++i)
+		out.offs[i + 1] = ps.end(i) - ps.begin(i);
+	for (size_t r = 0; r < runs.size(); ++r)
+		for (size_t k = 0; k < runs[r].wids.size(); ++k)
+			out.offs[runs[r].wids[k] + 1] += runs[r].offs[k + 1] - runs[r].offs[k];
+	for (size_t i = 0; i < nw; ++i)
+		out.offs[i + 1] += out.offs[i];
+	out.resize(out.offs[nw]);
+
+	//the next entry of every word
+	vector<size_t> pos(out.offs.begin(), out.offs.end() - 1);
+	parallelFor(*pool, 0, nw, 1024, [&](size_t b, size_t e)
+	{
+		for (size_t i = b; i < e; ++i)
+			for (size_t j = ps.begin(i), jend = ps.end(i); j < jend; ++j, ++pos[i])
+			{
+				out.docs[pos[i]] = ps.docs[j];
+				out.counts[pos[i]] = ps.counts[j];
+				out.vals[pos[i]] = ps.vals[j];
+			}
+	});
+	ivPostings().swap(ps);
+
+	//every run is freed once it is copied
+	for (size_t r = 0; r < runs.size(); ++r)
+	{
+		Run const& run = runs[r];
+		parallelFor(*pool, 0, run.wids.size(), 1024, [&](size_t b, size_t e)
+		{
+			for (size_t k = b; k < e; ++k)
+			{
+				size_t& o = pos[run.wids[k]];
+				for (size_t j = run.offs[k], jend = run.offs[k + 1]; j < jend; ++j, ++o)
+				{
+					out.docs[o] = run.docs[j];
+					out.counts[o] = run.counts[j];
+				}
+			}
+		});
+		runs[r] = Run();
+	}
+	runs.clear();
+
+	ps.swap(out);
+	for (size_t i = 0; i < nw; ++i)
+		ivf.words[i].ndocs = ps.end(i) - ps.begin(i);
+	times[2] += timer.toc();
+
+	ivf.nwords = nwords;
+	ivf.ndocs = ivf.docs.size();
+
+	cout << __FUNCTION__ << ": " << ivf.ndocs << " documents, count " << times[0] << " s, sort " 
+		<< times[1] << " s, postings " << times[2] << " s, threads " << pool->size() << endl;
+}
 
 //------------------------------------------------------------------------
 void ivFile::computeStats()
@@ -143,82 +795,148 @@ void ivFile::computeStats()
 	Norm norm = params.norm;
 
 	cout << __FUNCTION__ << "wt " << wt << " norm " << norm << endl;
-	uint i;
+	this->checkRaw();
+	this->unmap();
+
+	ThreadPool pool(this->nthreads);
+	Timer timer;
+	timer.tic();
 
 	//reset documents
-	for (i=0; i<this->ndocs; ++i)
+	parallelFor(pool, 0, this->ndocs, 4096, [&](size_t b, size_t e)
 	{
-		this->docs[i].norml0 = 0;
-		this->docs[i].norml1 = 0;
-		this->docs[i].norml2 = 0;
-		this->docs[i].nwords = 0;
-		this->docs[i].words.clear();
-	}
+		for (size_t i = b; i < e; ++i)
+		{
+			this->docs[i].norml0 = 0;
+			this->docs[i].norml1 = 0;
+			this->docs[i].norml2 = 0;
+			this->docs[i].nwords = 0;
+		}
+	});
+
+	//weight the values
+	typedef void (ivFile::*Kernel)(ThreadPool&);
+	static Kernel const weighKernels[WEIGHT_LAST] = {
+		&ivFile::weighKernel<WEIGHT_NONE>, &ivFile::weighKernel<WEIGHT_BIN>,
+		&ivFile::weighKernel<WEIGHT_TF>, &ivFile::weighKernel<WEIGHT_TFIDF> };
+	(this->*weighKernels[wt])(pool);
+	double tweight = timer.toc();
+
+	//the values of every document in the word order: a counting sort of
+	//the postings by document over ranges of words
+	size_t const parts = max<size_t>(1, min<size_t>(pool.size(), this->nwords));
+	vector<vector<uint> > cnt(parts, vector<uint>(this->ndocs, 0));
+	parallelFor(pool, 0, parts, 1, [&](size_t pb, size_t pe)
+	{
+		for (size_t p = pb; p < pe; ++p)
+			for (size_t i = partBegin(this->nwords, parts, p), iend = partBegin(this->nwords, parts, p + 1); 
+				i < iend; ++i)
+			{
+				for (size_t j = postings.begin(i), jend = postings.end(i); j < jend; ++j)
+					cnt[p][postings.docs[j]]++;
+			}
+	});
 
-	//now loop and compute word frequency for every document and norms
-	for (i=0; i<this->nwords; ++i)
+	vector<size_t> doffs(this->ndocs + 1);
+	partOffsets(pool, cnt, doffs);
+
+	vector<float> dvals(doffs[this->ndocs]);
+	parallelFor(pool, 0, parts, 1, [&](size_t pb, size_t pe)
+	{
+		for (size_t p = pb; p < pe; ++p)
+			for (size_t i = partBegin(this->nwords, parts, p), iend = partBegin(this->nwords, parts, p + 1); 
+				i < iend; ++i)
+			{
+				for (size_t j = postings.begin(i), jend = postings.end(i); j < jend; ++j)
+					dvals[cnt[p][postings.docs[j]]++] = postings.vals[j];
+			}
+	});
+	cnt.clear();
+
+	//document norms, summed in the word order so that they don't depend
+	//on the number of threads
+	parallelFor(pool, 0, this->ndocs, 1024, [&](size_t b, size_t e)
 	{
-		//get the word
-		ivWord* w = &this->words[i];
+		for (size_t d = b; d < e; ++d)
+		{
+			ivDoc& doc = this->docs[d];
+			for (size_t j = doffs[d]; j < doffs[d + 1]; ++j)
+			{
+				doc.norml0 += 1;
+				doc.norml1 += dvals[j];
+				doc.norml2 += (dvals[j] * dvals[j]);
+			}
+			doc.nwords = doffs[d + 1] - doffs[d];
+		}
+	});
+	double tnorm = timer.toc();
 
-		//get number of documents for this word
-		w->ndocs = w->docs.size();
+	//now normalize vals
+	static Kernel const normKernels[NORM_LAST] = {
+		&ivFile::normKernel<NORM_NONE>, &ivFile::normKernel<NORM_L0>,
+		&ivFile::normKernel<NORM_L1>, &ivFile::normKernel<NORM_L2> };
+	(this->*normKernels[norm])(pool);
+	double tnormalize = timer.toc();
+
+	this->computeWordBounds(pool);
 
-		//loop on its documents
-		ivWordDocIt wdit;
-		for (wdit = w->docs.begin(); wdit != w->docs.end(); wdit++)
+	cout << __FUNCTION__ << ": weights " << tweight << " s, norms " << tnorm - tweight 
+		<< " s, normalization " << tnormalize - tnorm << " s, threads " << pool.size() << endl;
+}
+
+//------------------------------------------------------------------------
+template <ivFile::Weight W>
+void ivFile::weighKernel(ThreadPool& pool)
+{
+	//the words are independent
+	parallelFor(pool, 0, this->nwords, 256, [&](size_t b, size_t e)
+	{
+		for (size_t i = b; i < e; ++i)
 		{
-			//get the word document id
-			uint doc = wdit->doc;
+			//get the word
+			ivWord* w = &this->words[i];
 
-			//get the value and weight it
-			wdit->val = this->weightVal(wdit->count, *w, this->docs[doc], wt);
+			//get number of documents for this word
+			w->ndocs = postings.end(i) - postings.begin(i);
 
-			//update norms
-			this->docs[doc].norml0 += 1;
-			this->docs[doc].norml1 += wdit->val;
-			this->docs[doc].norml2 += (wdit->val * wdit->val);
+			for (size_t j = postings.begin(i), jend = postings.end(i); j < jend; ++j)
+				postings.vals[j] = this->weightVal<W>(postings.counts[j], *w, this->docs[postings.docs[j]]);
+		}
+	});
+}
 
-			//add this word to list of words of this document
-			this->docs[doc].words.push_back(i);
-			this->docs[doc].nwords++;
+template <ivFile::Norm N>
+void ivFile::normKernel(ThreadPool& pool)
+{
+	parallelFor(pool, 0, this->nwords, 256, [&](size_t b, size_t e)
+	{
+		for (size_t i = b; i < e; ++i)
+		{
+			//loop on its documents
+			for (size_t j = postings.begin(i), jend = postings.end(i); j < jend; ++j)
+				//normalize
+				postings.vals[j] = this->normVal<N>(postings.vals[j], this->docs[postings.docs[j]]);
 		}
-	}
+	});
+}
 
-	//now normalize vals
-	for (i=0; i<this->nwords; ++i)
-	{
-		//get the word
-		ivWord* w = &this->words[i];
-
-		//loop on its documents
-		for (ivWordDocIt wdit = w->docs.begin(), wditend = w->docs.end(); 
-			wdit != wditend; wdit++)
-			//normalize
-			wdit->val = this->normVal(wdit->val, this->docs[wdit->doc], norm);
-	}
-
-	//cout << "computeStats done" << endl;
-	//cout << "ndocs = " << ndocs << endl;
-	//cout << "nwords = " << nwords << endl;
-	//cout << "Words: " << endl;
-	//for (i = 0; i < nwords; ++i)
-	//{
-	//	cout << words[i] << endl;
-	//}
-
-	//  for (i=0; i<this->docs[5].nwords; ++i)
-	//  {
-	//    ivWordDocIt wdit;
-	//    for (wdit=this->words[(uint)this->docs[5].words[i]].docs.begin();
-	//      wdit!=this->words[(uint)this->docs[5].words[i]].docs.end(); wdit++)
-	//    {
-	//      if (wdit->doc!=5)
-	//        continue;
-	//      
-	//      cout << wdit->val << " ";
-	//    }
-	//  }
+//------------------------------------------------------------------------
+void ivFile::computeWordBounds(ThreadPool& pool)
+{
+	parallelFor(pool, 0, this->nwords, 256, [&](size_t b, size_t e)
+	{
+		for (size_t i = b; i < e; ++i)
+		{
+			ivWord& w = this->words[i];
+			w.maxval = w.minval = 0;
+			size_t j = postings.begin(i), jend = postings.end(i);
+			if (j < jend)
+			{
+				w.maxval = *max_element(postings.vals.begin() + j, postings.vals.begin() + jend);
+				w.minval = *min_element(postings.vals.begin() + j, postings.vals.begin() + jend);
+			}
+		}
+	});
 }
 
 //------------------------------------------------------------------------
@@ -226,6 +944,22 @@ float ivFile::weightVal(float val, ivWord const& word, ivDoc const& doc, ivFile:
 {
 	switch(wt)
 	{
+	case WEIGHT_BIN:
+		return this->weightVal<WEIGHT_BIN>(val, word, doc);
+	case WEIGHT_TF:
+		return this->weightVal<WEIGHT_TF>(val, word, doc);
+	case WEIGHT_TFIDF:
+		return this->weightVal<WEIGHT_TFIDF>(val, word, doc);
+	default:
+		return this->weightVal<WEIGHT_NONE>(val, word, doc);
+	}
+}
+
+template <ivFile::Weight W>
+float ivFile::weightVal(float val, ivWord const& word, ivDoc const& doc) const
+{
+	switch(W)
+	{
 	case WEIGHT_BIN:
 		val = val>0 ? 1 : 0;
 		break;
@@ -247,6 +981,22 @@ float ivFile::normVal(float val, ivDoc& doc, ivFile::Norm norm) const
 {
 	switch(norm)
 	{
+	case NORM_L0:
+		return this->normVal<NORM_L0>(val, doc);
+	case NORM_L1:
+		return this->normVal<NORM_L1>(val, doc);
+	case NORM_L2:
+		return this->normVal<NORM_L2>(val, doc);
+	default:
+		return this->normVal<NORM_NONE>(val, doc);
+	}
+}
+
+template <ivFile::Norm N>
+float ivFile::normVal(float val, ivDoc& doc) const
+{
+	switch(N)
+	{
 	case NORM_L0:
 		val /= (EPS + doc.norml0);
 		break;
@@ -267,6 +1017,30 @@ float ivFile::dist(float val1, float val2, ivFile::Dist dist) const
 {
 	switch(dist)
 	{
+	case DIST_L1:
+		return this->dist<DIST_L1>(val1, val2);
+	case DIST_L2:
+		return this->dist<DIST_L2>(val1, val2);
+	case DIST_HAM:
+		return this->dist<DIST_HAM>(val1, val2);
+	case DIST_KL:
+		return this->dist<DIST_KL>(val1, val2);
+	case DIST_COS:
+		return this->dist<DIST_COS>(val1, val2);
+	case DIST_JAC:
+		return this->dist<DIST_JAC>(val1, val2);
+	case DIST_HISTINT:
+		return this->dist<DIST_HISTINT>(val1, val2);
+	default:
+		return val1;
+	}
+}
+
+template <ivFile::Dist D>
+float ivFile::dist(float val1, float val2) const
+{
+	switch(D)
+	{
 	case DIST_L1:
 		val1 -= val2;
 		val1 = val1>0 ? val1 : -val1;
@@ -363,11 +1137,10 @@ float ivFile::dist2Norm(ivDoc const & doc, ivFile::Dist dist, ivFile::Norm norm)
 
 void ivFile::search(const wordtype* wlabel, uint ntokens, 
 	ivFile::Weight weight, ivFile::Norm norm, ivFile::Dist dist,
-	bool overlapOnly, uint k, ivNodeList& scorelist) const
-	//        float* scores, uint* docs, uint& nret)
+	bool overlapOnly, uint k, SearchNorms const& sn, ThreadPool* pool, 
+	vector<Accumulator>& accs, ivNodeList& scorelist, SearchStats& stats) const
 {
-	cerr << __FUNCTION__ << endl;
-
+	scorelist.clear();
 	//return if empty
 	if (words.empty()) return;
 
@@ -382,7 +1155,7 @@ void ivFile::search(const wordtype* wlabel, uint ntokens,
 	{
 		//skip word if invalid
 		uint wr = (uint) wlabel[i];
-		if (wr==0 || wr>nwords) continue;
+		if (wr==0 || wr>nwords || words[wr - 1].stop) continue;
 		//get that word
 		ivNode w; 
 		w.id = wr - 1;
@@ -415,108 +1188,608 @@ void ivFile::search(const wordtype* wlabel, uint ntokens,
 	//get this documents's norm
 	float docNorm = dist2Norm(doc, dist, norm);
 
-	//if computing distance to all documents, update score list with this word's
-	// norm. The initial one has twice the norm of every document
-	if (!overlapOnly && norm==ivFile::NORM_NONE)
+	//normalize this doc vals
+	for (ivNodeIt wit=wordcount.begin(), witend = wordcount.end(); wit!=witend; wit++)
+		wit->val = normVal(wit->val, doc, norm);
+
+	//distances that add up the contributions of the words can skip the 
+	//documents that can't get into the top k (MaxScore). The contributions
+	//must not be negative
+	bool prune = (this->pruning || this->isImpactOrdered()) && k > 0 && 
+		(dist == DIST_COS || dist == DIST_HISTINT);
+	size_t npostings = 0;
+	for (ivNodeIt wit=wordcount.begin(), witend = wordcount.end(); wit!=witend; wit++)
+	{
+		prune = prune && wit->val >= 0 && words[wit->id].minval >= 0;
+		npostings += words[wit->id].ndocs;
+	}
+
+	//every accumulator takes a range of the documents and keeps its k best
+	//touched ones in a heap with the worst one on top, all of them if k is 0
+	size_t const nd = docs.size();
+	size_t const nranges = accs.size();
+	vector<ivNodeList> heaps(nranges);
+	auto range = [&](size_t r)
+	{
+		Accumulator& acc = accs[r];
+		acc.first = partBegin(nd, nranges, r);
+		acc.scored = 0;
+		if (prune && this->isImpactOrdered())
+		{
+			this->impactSearch(wordcount, doc, dist, k, acc, heaps[r]);
+			return;
+		}
+		if (prune)
+		{
+			this->maxScore(wordcount, doc, docNorm, dist, sn, k, partBegin(nd, nranges, r + 1), 
+				acc, heaps[r]);
+			return;
+		}
+		this->accumulate(wordcount, docNorm, dist, sn, partBegin(nd, nranges, r + 1), acc);
+
+		for (size_t t = 0; t < acc.touched.size(); ++t)
+		{
+			ivNode ds;
+			ds.id = acc.touched[t];
+			ds.val = finalVal(acc.vals[ds.id - acc.first], docs[ds.id], doc, dist);
+			offer(ds, k>0 ? k : acc.touched.size(), heaps[r]);
+		}
+	};
+	if (nranges == 1)
+		range(0);
+	else
+		parallelFor(*pool, 0, nranges, 1, [&](size_t b, size_t e)
+		{
+			for (size_t r = b; r < e; ++r)
+				range(r);
+		});
+
+	//merge the heaps
+	size_t ntouched = 0, nscored = 0;
+	for (size_t r = 0; r < nranges; ++r)
+	{
+		ntouched += accs[r].touched.size();
+		nscored += accs[r].scored;
+	}
+	stats.postings += npostings;
+	stats.skipped += npostings - nscored;
+	size_t ncand = overlapOnly ? ntouched : nd;
+	size_t kk = (k>0 && k<ncand) ? k : ncand;
+	if (nranges == 1)
+		scorelist.swap(heaps[0]);
+	else
+	{
+		scorelist.reserve(kk);
+		for (size_t r = 0; r < nranges; ++r)
+			for (size_t t = 0; t < heaps[r].size(); ++t)
+				offer(heaps[r][t], kk, scorelist);
+	}
+	ivNodeCmpValIdAsc cmp;
+
+	//documents without common words have just the sum of norms, which grows
+	//along sn.order
+	if (!overlapOnly)
+	{
+		size_t r = 0;
+		for (size_t o = 0; o < nd; ++o)
+		{
+			uint32_t d = sn.order.empty() ? (uint32_t)o : sn.order[o];
+			//the range of the document
+			while (r > 0 && d < accs[r].first) --r;
+			while (r + 1 < nranges && d >= accs[r + 1].first) ++r;
+			if (accs[r].seen[d - accs[r].first]) continue;
+
+			ivNode ds;
+			ds.id = d;
+			ds.val = finalVal(docNorm + sn.norms[d], docs[d], doc, dist);
+			if (scorelist.size() == kk && cmp(scorelist.front(), ds))
+			{
+				//all the next ones are worse
+				if (sn.order.empty() || scorelist.front().val < ds.val) break;
+				//the next ones with the same norm have larger ids, skip them
+				vector<float> const& nv = sn.norms;
+				o = upper_bound(sn.order.begin() + o, sn.order.end(), d, 
+					[&nv](uint32_t a, uint32_t b) { return nv[a] < nv[b]; }) - sn.order.begin() - 1;
+				continue;
+			}
+			offer(ds, kk, scorelist);
+		}
+	}
+
+	//sort ascendingly
+	sort_heap(scorelist.begin(), scorelist.end(), cmp);
+
+	//reset the accumulators
+	for (size_t r = 0; r < nranges; ++r)
 	{
-		//loop on the documents and add to score list
-		for (ivNodeIt dsit = scorelist.begin(), dsend = scorelist.end(); dsit!=dsend; dsit++)
-			//update norm to include this docs norm
-			dsit->val = (dsit->val / 2) +  docNorm;      
+		Accumulator& acc = accs[r];
+		for (size_t t = 0; t < acc.touched.size(); ++t)
+			acc.seen[acc.touched[t] - acc.first] = 0;
+		acc.touched.clear();
 	}
 
+	//clean memory
+	wordcount.clear();  
+}
+
+//------------------------------------------------------------------------
+void ivFile::accumulate(ivNodeList const& wordcount, float docNorm, ivFile::Dist dist, 
+	SearchNorms const& sn, size_t last, Accumulator& acc) const
+{
+	typedef void (ivFile::*Kernel)(ivNodeList const&, float, SearchNorms const&, size_t, Accumulator&) const;
+	static Kernel const kernels[DIST_LAST] = {
+		&ivFile::accumulateKernel<DIST_L1>, &ivFile::accumulateKernel<DIST_L2>,
+		&ivFile::accumulateKernel<DIST_HAM>, &ivFile::accumulateKernel<DIST_KL>,
+		&ivFile::accumulateKernel<DIST_COS>, &ivFile::accumulateKernel<DIST_JAC>,
+		&ivFile::accumulateKernel<DIST_HISTINT> };
+	(this->*kernels[dist])(wordcount, docNorm, sn, last, acc);
+}
+
+template <ivFile::Dist D>
+void ivFile::accumulateKernel(ivNodeList const& wordcount, float docNorm, 
+	SearchNorms const& sn, size_t last, Accumulator& acc) const
+{
+	size_t const first = acc.first;
+
+	//the accumulator keeps a score for every document of the range, only the 
+	//touched ones are valid
+	acc.vals.resize(last - first);
+	acc.seen.resize(last - first, 0);
+
+	//decoded entries of a compressed block, or the value of an impact 
+	//segment for all its entries
+	uint32_t bufdocs[ivPacked::BLOCK];
+	float bufvals[ivPacked::BLOCK];
+
+	//the entries are added a block at a time by the widest kernel of the cpu
+	ivBlockScore::Kernel const score = ivBlockScore::kernel(D, ivBlockScore::best());
+
 	//now loop on the document words and update scores  
-	for (ivNodeIt wit=wordcount.begin(), witend = wordcount.end(); wit!=witend; wit++)
+	for (ivNodeList::const_iterator wit=wordcount.begin(), witend = wordcount.end(); wit!=witend; wit++)
 	{    
 		//get the word    
-		ivWord const& word = words[(uint)wit->id];
-		//    cout << "\nword: " << wit->id << "\n";
+		uint wid = (uint)wit->id;
+		float const qval = wit->val;
+		float const qnorm = this->dist<D>(qval, 0);
 
-		//normalize this doc val
-		wit->val = normVal(wit->val, doc, norm);
-		//    cout << words.size() << endl;
+		//add the entries of the range out of n ascending ones of the word
+		auto add = [&](uint32_t const* wdocs, float const* wvals, size_t n)
+		{
+			size_t jb = lower_bound(wdocs, wdocs + n, (uint32_t)first) - wdocs;
+			size_t je = lower_bound(wdocs + jb, wdocs + n, (uint32_t)last) - wdocs;
+			acc.scored += je - jb;
+			for (size_t cb = jb; cb < je; cb += ivPacked::BLOCK)
+			{
+				size_t ce = min(je, cb + size_t(ivPacked::BLOCK));
+
+				//get the documents in the accumulator, init with sum of norms
+				for (size_t j = cb; j < ce; ++j)
+				{
+					uint32_t wdoc = wdocs[j];
+					if (!acc.seen[wdoc - first])
+					{
+						acc.seen[wdoc - first] = 1;
+						acc.touched.push_back(wdoc);
+						acc.vals[wdoc - first] = docNorm + sn.norms[wdoc];
+					}
+				}
+
+				//compute distance
+				score(qval, qnorm, wdocs + cb, wvals + cb, ce - cb, first, &acc.vals[0]);
+			}
+		};
 
-		//loop on the documents
-		for (ivWordDocCIt wdit = word.docs.begin(), wditend = word.docs.end(); 
-			wdit != wditend; wdit++)
+		//impact ordered entries, the segments one after the other
+		if (this->isImpactOrdered())
 		{
-			//      cout << " doc: "<< wdit->doc+1;
-			//get that document in the score list
-			ivNodeIt dsit; 
-			//if not overlap or scorelist has equal length to docs
-			if (!overlapOnly || scorelist.size()==docs.size())
+			for (size_t s = impacts.begin(wid), send = impacts.end(wid); s < send; ++s)
 			{
-				dsit = scorelist.begin() + wdit->doc;
+				std::fill(bufvals, bufvals + ivPacked::BLOCK, impacts.value(impacts.segs[s].impact));
+				for (size_t j = impacts.first(s), jend = impacts.last(s); j < jend; j += ivPacked::BLOCK)
+					add(&impacts.docs[j], bufvals, min(jend - j, size_t(ivPacked::BLOCK)));
 			}
-			//if overlap only, then search for that document in the score list and 
-			//insert if not already there
+			continue;
+		}
+
+		//the entries of the range
+		if (!this->isCompressed())
+		{
+			size_t b = postings.begin(wid), e = postings.end(wid);
+			if (b < e)
+				add(&postings.docs[b], &postings.vals[b], e - b);
+			continue;
+		}
+
+		//a block of them at a time when compressed. The first block that may
+		//have documents of the range is the one before the first block that 
+		//starts after them
+		size_t bbegin = packed.begin(wid), bend = packed.end(wid);
+		if (first > 0 && bend - bbegin > 1)
+		{
+			vector<ivPacked::Block>::const_iterator bb = packed.blocks.begin();
+			bbegin = lower_bound(bb + bbegin + 1, bb + bend, first, 
+				[](ivPacked::Block const& blk, size_t d) { return blk.base < d; }) - bb - 1;
+		}
+		for (size_t b = bbegin; b < bend; ++b)
+		{
+			if (b > bbegin && packed.blocks[b].base >= last) break;
+			size_t n = packed.decode(b, bufdocs, bufvals);
+			add(bufdocs, bufvals, n);
+		}
+	}  
+}
+
+//------------------------------------------------------------------------
+void ivFile::maxScore(ivNodeList const& wordcount, ivDoc const& doc, float docNorm, ivFile::Dist dist, 
+	SearchNorms const& sn, uint k, size_t last, Accumulator& acc, ivNodeList& heap) const
+{
+	size_t const first = acc.first;
+	size_t const nterms = wordcount.size();
+	acc.seen.resize(last - first, 0);
+
+	//bound of the contribution of every word, the words by ascending bound
+	//and the sums of the bounds in that order
+	vector<double> ub(nterms);
+	vector<size_t> ord(nterms);
+	vector<Cursor> cursors;
+	cursors.reserve(nterms);
+	for (size_t t = 0; t < nterms; ++t)
+	{
+		ivNode const& w = wordcount[t];
+		ub[t] = this->dist(w.val, words[w.id].maxval, dist);
+		ord[t] = t;
+		cursors.push_back(Cursor(postings, packed, this->isCompressed(), w.id, first, last));
+	}
+	sort(ord.begin(), ord.end(), [&ub](size_t a, size_t b) { return ub[a] < ub[b]; });
+	vector<double> pre(nterms + 1, 0);
+	for (size_t m = 0; m < nterms; ++m)
+		pre[m + 1] = pre[m] + ub[ord[m]];
+
+	//true if a document with the sum bounded by bound can't get into the 
+	//heap: the distance is 1 - sum, and the slack covers the rounding of the
+	//float sums
+	double const slack = 1 + (nterms + 2) * FLT_EPSILON;
+	auto beaten = [&](double bound) -> bool
+	{
+		return heap.size() == k && 1 - (float)(bound * slack) > heap.front().val;
+	};
+
+	//values of the document in the words it has
+	vector<float> wvals(nterms);
+	vector<size_t> hits;
+
+	//the first ne words by bound are not essential: a document that has only 
+	//them can't get into the heap. The cursors of the essential ones are in 
+	//a heap with the smallest document on top
+	size_t ne = 0;
+	vector<size_t> ess;
+	auto later = [&cursors](size_t a, size_t b) { return cursors[a].doc() > cursors[b].doc(); };
+	auto essential = [&]()
+	{
+		while (ne < nterms && beaten(pre[ne + 1])) ++ne;
+		ess.clear();
+		for (size_t m = ne; m < nterms; ++m)
+			if (!cursors[ord[m]].done())
+				ess.push_back(ord[m]);
+		make_heap(ess.begin(), ess.end(), later);
+	};
+	essential();
+
+	while (!ess.empty())
+	{
+		//next document of the essential words and its values in them
+		uint32_t d = cursors[ess.front()].doc();
+		double sum = 0;
+		hits.clear();
+		while (!ess.empty() && cursors[ess.front()].doc() == d)
+		{
+			size_t t = ess.front();
+			Cursor& c = cursors[t];
+			wvals[t] = c.val();
+			hits.push_back(t);
+			sum += this->dist(wordcount[t].val, wvals[t], dist);
+			++acc.scored;
+
+			pop_heap(ess.begin(), ess.end(), later);
+			c.next();
+			if (c.done())
+				ess.pop_back();
 			else
+				push_heap(ess.begin(), ess.end(), later);
+		}
+
+		//then in the others, the largest bound first, as long as the document
+		//can still get into the heap
+		bool pruned = false;
+		for (size_t m = ne; m-- > 0; )
+		{
+			if (beaten(sum + pre[m + 1]))
+			{
+				pruned = true;
+				break;
+			}
+			size_t t = ord[m];
+			Cursor& c = cursors[t];
+			c.seek(d);
+			if (!c.done() && c.doc() == d)
+			{
+				wvals[t] = c.val();
+				hits.push_back(t);
+				sum += this->dist(wordcount[t].val, wvals[t], dist);
+				++acc.scored;
+			}
+		}
+		if (pruned) continue;
+
+		//the exact score, summed in the word order like accumulate
+		sort(hits.begin(), hits.end());
+		float dval = docNorm + sn.norms[d];
+		for (size_t h = 0; h < hits.size(); ++h)
+		{
+			size_t t = hits[h];
+			dval -= this->dist(wordcount[t].val,0,dist) + this->dist(wvals[t],0,dist);
+			dval += this->dist(wordcount[t].val, wvals[t], dist);
+		}
+		acc.seen[d - first] = 1;
+		acc.touched.push_back(d);
+
+		ivNode ds;
+		ds.id = d;
+		ds.val = finalVal(dval, docs[d], doc, dist);
+		bool full = heap.size() == k;
+		float worst = full ? heap.front().val : 0;
+		offer(ds, k, heap);
+
+		//a closer worst document may make more words not essential
+		if (heap.size() == k && (!full || heap.front().val < worst) && 
+			ne < nterms && beaten(pre[ne + 1]))
+			essential();
+	}
+}
+
+//------------------------------------------------------------------------
+void ivFile::impactSearch(ivNodeList const& wordcount, ivDoc const& doc, ivFile::Dist dist, 
+	uint k, Accumulator& acc, ivNodeList& heap) const
+{
+	size_t const nd = docs.size();
+	size_t const nterms = wordcount.size();
+	acc.vals.resize(nd);
+	acc.seen.resize(nd, 0);
+
+	//the segments of all the words by descending contribution, which is the
+	//same for all the entries of a segment and falls along the segments of
+	//a word. bound is the sum of the contributions of the next segment of
+	//every word, the most a document can still get
+	struct Item
+	{
+		float c;
+		size_t t;
+		size_t s;
+	};
+	vector<Item> items;
+	vector<size_t> next(nterms);
+	double bound = 0;
+	for (size_t t = 0; t < nterms; ++t)
+	{
+		ivNode const& w = wordcount[t];
+		next[t] = impacts.begin(w.id);
+		for (size_t s = impacts.begin(w.id), send = impacts.end(w.id); s < send; ++s)
+		{
+			Item it;
+			it.c = this->dist(w.val, impacts.value(impacts.segs[s].impact), dist);
+			it.t = t;
+			it.s = s;
+			items.push_back(it);
+		}
+		if (next[t] < impacts.end(w.id))
+			bound += this->dist(w.val, impacts.value(impacts.segs[next[t]].impact), dist);
+	}
+	stable_sort(items.begin(), items.end(), [](Item const& a, Item const& b) { return a.c > b.c; });
+
+	//the k+1 documents with the largest scores so far, flagged with 2 in 
+	//seen, and the smallest of them. Scores only grow, so a document that 
+	//leaves them doesn't come back unless it beats the smallest. They are 
+	//tracked once the best score is beyond the bound, before that the
+	//search can't stop
+	vector<uint32_t> top;
+	size_t low = 0;
+	vector<float>& score = acc.vals;
+	float best = 0;
+	bool tracking = false;
+	//a before b: larger score, ties by id like the heaps
+	auto before = [&score](uint32_t a, uint32_t b)
+	{
+		return score[a] > score[b] || (score[a] == score[b] && a < b);
+	};
+	auto findLow = [&]()
+	{
+		low = 0;
+		for (size_t i = 1; i < top.size(); ++i)
+			if (before(top[low], top[i]))
+				low = i;
+	};
+	auto track = [&]()
+	{
+		tracking = true;
+		top = acc.touched;
+		size_t n = min<size_t>(k + 1, top.size());
+		partial_sort(top.begin(), top.begin() + n, top.end(), before);
+		top.resize(n);
+		for (size_t i = 0; i < n; ++i)
+			acc.seen[top[i]] |= 2;
+		findLow();
+	};
+
+	//the float sums may be off by a few roundings
+	double const slack = 1 + (nterms + 2) * FLT_EPSILON;
+	vector<float> tv;
+	for (size_t i = 0; i < items.size(); ++i)
+	{
+		Item const& it = items[i];
+		for (size_t j = impacts.first(it.s), jend = impacts.last(it.s); j < jend; ++j)
+		{
+			uint32_t d = impacts.docs[j];
+			uint8_t& f = acc.seen[d];
+			if (!f)
 			{
-				ivNode ds; 
-				ds.id = wdit->doc;
-				dsit = lower_bound(scorelist.begin(), scorelist.end(), ds);
+				f = 1;
+				acc.touched.push_back(d);
+				score[d] = 0;
+			}
+			score[d] += it.c;
 
-				//check if to insert to the list of scores (new doc)
-				if (dsit==scorelist.end() || ds<(*dsit))
+			if (!tracking)
+				best = max(best, score[d]);
+			else if (f & 2)
+			{
+				if (top[low] == d)
+					findLow();
+			}
+			else if (top.size() <= k)
+			{
+				f |= 2;
+				top.push_back(d);
+				if (before(top[low], d))
+					low = top.size() - 1;
+			}
+			else if (before(d, top[low]))
+			{
+				acc.seen[top[low]] &= ~2;
+				top[low] = d;
+				f |= 2;
+				findLow();
+			}
+		}
+		acc.scored += impacts.last(it.s) - impacts.first(it.s);
+
+		//the rest of the word
+		++next[it.t];
+		size_t wend = impacts.end(wordcount[it.t].id);
+		bound -= it.c;
+		if (next[it.t] < wend)
+			bound += this->dist(wordcount[it.t].val, impacts.value(impacts.segs[next[it.t]].impact), dist);
+
+		//done when the k-th score is beyond the reach of the k+1-th one and 
+		//of the documents not in the top, which have less
+		if (i + 1 == items.size())
+			break;
+		if (!tracking && best > max(bound, 0.0) * slack)
+			track();
+		if (top.size() < k)
+			continue;
+		tv.clear();
+		for (size_t j = 0; j < top.size(); ++j)
+			tv.push_back(score[top[j]]);
+		sort(tv.begin(), tv.end(), greater<float>());
+		float kth = tv[k - 1];
+		float next1 = top.size() > k ? tv[k] : 0;
+		if (kth > (next1 + max(bound, 0.0)) * slack)
+		{
+			//the k best are known, add the segments they are missing
+			if (top.size() > k)
+			{
+				acc.seen[top[low]] &= ~2;
+				top.erase(top.begin() + low);
+			}
+			for (size_t t = 0; t < nterms; ++t)
+			{
+				for (size_t s = next[t], send = impacts.end(wordcount[t].id); s < send; ++s)
 				{
-					//init with sum of norms
-					ds.val = docNorm + dist2Norm(docs[ds.id], dist, norm);
-					//insert
-					dsit = scorelist.insert(dsit, ds);
+					float c = this->dist(wordcount[t].val, impacts.value(impacts.segs[s].impact), dist);
+					vector<uint32_t>::const_iterator sb = impacts.docs.begin() + impacts.first(s);
+					vector<uint32_t>::const_iterator se = impacts.docs.begin() + impacts.last(s);
+					for (size_t j = 0; j < top.size(); ++j)
+						if (binary_search(sb, se, top[j]))
+						{
+							score[top[j]] += c;
+							++acc.scored;
+						}
 				}
 			}
-
-			//      if (dsit->id == 5) //(wdit->doc == 5)
-			//        cout << "1-> " << wit->val << " 2->" << wdit->val << "\n";               
-			//compute distance
-			dsit->val -= this->dist(wit->val,0,dist) + this->dist(wdit->val,0,dist);
-			dsit->val += this->dist(wit->val, wdit->val, dist);
+			break;
 		}
-	}  
+	}
+	if (!tracking)
+		track();
 
-	//further processing
-	if (dist == ivFile::DIST_JAC)
+	for (size_t j = 0; j < top.size(); ++j)
 	{
-		//we already have the intersections, so update to compute the Jac distance
-		// dist = 1 - intersection / union
-		// where intersection = dsit->val
-		// and union = nwords1 + nwords2 - intersection
-		for (ivNodeIt dsit=scorelist.begin(), dsitEnd=scorelist.end(); dsit!=dsitEnd; dsit++)
-			dsit->val = 1 - dsit->val / (docs[dsit->id].norml0 + doc.norml0 - dsit->val);
+		ivNode ds;
+		ds.id = top[j];
+		ds.val = finalVal(score[top[j]], docs[top[j]], doc, dist);
+		offer(ds, k, heap);
 	}
-	else if (dist == ivFile::DIST_COS)
+}
+
+//------------------------------------------------------------------------
+float ivFile::finalVal(float val, ivDoc const& idoc, ivDoc const& doc, ivFile::Dist dist) const
+{
+	//we already have the intersections, so update to compute the Jac distance
+	// dist = 1 - intersection / union
+	// where intersection = val
+	// and union = nwords1 + nwords2 - intersection
+	if (dist == ivFile::DIST_JAC)
+		return 1 - val / (idoc.norml0 + doc.norml0 - val);
+	//update cosine distance by changing the range from -1 -> 1 
+	// (least similar -> most similar)
+	// to 0 -> 2 (most similar -> least similar)
+	// where newval = -oldval + 1
+	if (dist == ivFile::DIST_COS)
+		return 1 - val;
+	//update histogram intersection kernel by inverting and adding 1 
+	//(assuming normalization)
+	if (dist == ivFile::DIST_HISTINT)
+		return 1 - val;
+	return val;
+}
+
+//------------------------------------------------------------------------
+void ivFile::offer(ivNode const& ds, size_t k, ivNodeList& heap)
+{
+	ivNodeCmpValIdAsc cmp;
+	if (heap.size() < k)
 	{
-		//update cosine distance by changing the range from -1 -> 1 
-		// (least similar -> most similar)
-		// to 0 -> 2 (most similar -> least similar)
-		// where newval = -oldval + 1
-		for (ivNodeIt dsit=scorelist.begin(), dsitEnd=scorelist.end(); dsit!=dsitEnd; dsit++)
-			dsit->val = 1 -dsit->val;
+		heap.push_back(ds);
+		push_heap(heap.begin(), heap.end(), cmp);
 	}
-	else if (dist == ivFile::DIST_HISTINT)
+	else if (k > 0 && cmp(ds, heap.front()))
 	{
-		//update histogram intersection kernel by inverting and adding 1 
-		//(assuming normalization)
-		for (ivNodeIt dsit=scorelist.begin(), dsitEnd=scorelist.end(); dsit!=dsitEnd; dsit++)
-			dsit->val = 1 - dsit->val;
+		pop_heap(heap.begin(), heap.end(), cmp);
+		heap.back() = ds;
+		push_heap(heap.begin(), heap.end(), cmp);
 	}
+}
 
-	//sort ascendingly
-	ivNodeCmpValAsc ncv;
-	sort(scorelist.begin(), scorelist.end(), ncv);
-
-	//keep only k
-	if (k>0 && k<scorelist.size())
-		scorelist.resize(k);
+//------------------------------------------------------------------------
+void ivFile::initSearch(ivFile::Dist dist, bool overlapOnly, SearchNorms& sn) const
+{
+	size_t nd = docs.size();
+	sn.norms.resize(nd);
+	bool equal = true;
+	for (size_t i = 0; i < nd; ++i)
+	{
+		sn.norms[i] = dist2Norm(docs[i], dist, params.norm);
+		equal = equal && sn.norms[i] == sn.norms[0];
+	}
 
-	//clean memory
-	wordcount.clear();  
+	//order of the documents by norm, not needed if they are all equal
+	sn.order.clear();
+	if (!overlapOnly && !equal)
+	{
+		sn.order.resize(nd);
+		for (size_t i = 0; i < nd; ++i)
+			sn.order[i] = (uint32_t)i;
+		vector<float> const& nv = sn.norms;
+		sort(sn.order.begin(), sn.order.end(), [&nv](uint32_t a, uint32_t b)
+			{ return nv[a] < nv[b] || (nv[a] == nv[b] && a < b); });
+	}
 }
 
 //------------------------------------------------------------------------
 void ivFile::search(docvec const & data, 
 	ivFile::Dist dist,
-	bool overlapOnly, uint k, ivNodeLists& scorelists, bool verbose=false) const
+	bool overlapOnly, uint k, ivNodeLists& scorelists, bool verbose, unsigned threads, 
+	SearchStats* stats) const
 {
 	Weight weight = params.weight;
 	Norm norm     = params.norm;
@@ -529,45 +1802,72 @@ void ivFile::search(docvec const & data,
 	scorelists.resize(ndocs);
 	//   cout << "we have " << ndocs << " docs" << endl;
 
-	//initialize score list with full list of documents, and just copy it 
-	//afterwords. Init it with twice the norm
-	ivNodeList tscorelist;
-	if (!overlapOnly)
+	//norm terms of the documents, shared by the queries
+	SearchNorms sn;
+	initSearch(dist, overlapOnly, sn);
+
+	if (verbose && ndocs > 0)
+	{
+		cout << " doc:" << 0 << " / " << ndocs << endl;
+		cout.flush();
+	}
+
+	ThreadPool pool(threads);
+
+	//fewer queries than threads: the documents of every query are cut into
+	//ranges searched in parallel
+	if (ndocs < pool.size() && !this->isImpactOrdered())
 	{
-		tscorelist.resize(docs.size());
-		//loop on the documents and add to score list
-		ivDocCIt dit = docs.begin(), dend = docs.end();
-		ivNodeIt dsit = tscorelist.begin();
-		for (uint i=0; dit!=dend; dit++, dsit++, i++)
+		vector<Accumulator> accs(pool.size());
+		SearchStats st;
+		for (uint d=0; d<ndocs; d++)
 		{
-			//put the document id
-			dsit->id = i;
-			//put the initial distance: sum of norms
-			dsit->val = 2 * dist2Norm(*dit, dist, norm);
-		}  
+			const wordvec& doc = data[d];
+			search(doc.empty() ? nullptr : &doc[0], doc.size(), weight, norm, dist, overlapOnly, 
+				k, sn, &pool, accs, scorelists[d], st);
+		}
+		if (stats)
+			*stats = st;
+		return;
 	}
 
-	//now loop
-	for (uint d=0; d<ndocs; d++)
+	//every part has its own accumulator and takes the next few queries
+	//until there are none left
+	size_t const parts = max<size_t>(1, min<size_t>(pool.size(), ndocs));
+	boost::mutex mutex;
+	size_t next = 0;
+	SearchStats total;
+	parallelFor(pool, 0, parts, 1, [&](size_t pb, size_t pe)
 	{
-		if (verbose && (d==0/* ||  (d % (uint)round(0.1 * ndocs) == 0)*/) )
+		vector<Accumulator> accs(1);
+		SearchStats st;
+		for (;;)
 		{
-			cout << " doc:" << d << " / " << ndocs << endl;
-			cout.flush();
+			size_t b, e;
+			{
+				boost::lock_guard<boost::mutex> lock(mutex);
+				b = next;
+				e = next = min<size_t>(next + 16, ndocs);
+			}
+			if (b == e) break;
+
+			for (size_t d = b; d < e; ++d)
+			{
+				//get data for this document
+				const wordvec& doc = data[d];
+
+				//search for this document
+				search(doc.empty() ? nullptr : &doc[0], doc.size(), weight, norm, dist, overlapOnly, 
+					k, sn, nullptr, accs, scorelists[d], st);
+			}
 		}
-		//get data for this document
-		const wordvec& doc = data[d];
 
-		//make a copy of tscorelist
-		ivNodeList ttscorelist = tscorelist;
-		//search for this document
-		search(&(*doc.begin()), doc.size(), weight, norm, dist, overlapOnly, 
-			k, ttscorelist);
-		//put back into scorelists
-		scorelists[d] = ttscorelist;
-		//clear
-		ttscorelist.clear();
-	}
+		boost::lock_guard<boost::mutex> lock(mutex);
+		total.postings += st.postings;
+		total.skipped += st.skipped;
+	});
+	if (stats)
+		*stats = total;
 }
 
 //------------------------------------------------------------------------
@@ -578,6 +1878,157 @@ void ivFile::clear()
 
 	//clear words array
 	this->words.clear();
+	this->postings.clear();
+	this->packed.clear();
+	this->impacts.clear();
+	this->mapping.reset();
+}
+
+//------------------------------------------------------------------------
+void ivFile::compress()
+{
+	this->checkRaw();
+
+	this->packed.build(this->postings);
+	//free the raw entries
+	ivPostings().swap(this->postings);
+	this->mapping.reset();
+}
+
+void ivFile::impactOrder()
+{
+	this->checkRaw();
+	for (size_t i = 0; i < this->nwords; ++i)
+		if (this->words[i].minval < 0)
+			throw logic_error("Impacts of negative values");
+
+	this->impacts.build(this->postings);
+	ivPostings().swap(this->postings);
+	this->mapping.reset();
+}
+
+void ivFile::checkRaw() const
+{
+	if (this->isCompressed())
+		throw logic_error("The inverted file is compressed");
+	if (this->isImpactOrdered())
+		throw logic_error("The inverted file is impact ordered");
+}
+
+void ivFile::checkTarget(string const& filename) const
+{
+	if (this->isMapped() && this->mapping->isFile(filename))
+		throw logic_error("The inverted file is mapped from " + filename);
+}
+
+void ivFile::unmap()
+{
+	if (!this->isMapped())
+		return;
+	this->postings.detach();
+	this->mapping.reset();
+}
+
+size_t ivFile::indexBytes() const
+{
+	if (this->isCompressed())
+		return this->packed.bytes();
+	if (this->isImpactOrdered())
+		return this->impacts.bytes();
+	return this->postings.offs.size() * sizeof(size_t) + this->postings.docs.size() * 
+		(sizeof(uint32_t) + sizeof(uint32_t) + sizeof(float));
+}
+
+void ivFile::wordPostings(size_t i, vector<uint32_t>& wdocs, vector<float>& wvals) const
+{
+	wdocs.clear();
+	wvals.clear();
+	if (this->isCompressed())
+	{
+		uint32_t bufdocs[ivPacked::BLOCK];
+		float bufvals[ivPacked::BLOCK];
+		for (size_t b = packed.begin(i), bend = packed.end(i); b < bend; ++b)
+		{
+			size_t n = packed.decode(b, bufdocs, bufvals);
+			wdocs.insert(wdocs.end(), bufdocs, bufdocs + n);
+			wvals.insert(wvals.end(), bufvals, bufvals + n);
+		}
+	}
+	else if (this->isImpactOrdered())
+	{
+		//back to document order
+		vector<pair<uint32_t, float> > entries;
+		for (size_t s = impacts.begin(i), send = impacts.end(i); s < send; ++s)
+			for (size_t j = impacts.first(s), jend = impacts.last(s); j < jend; ++j)
+				entries.push_back(make_pair(impacts.docs[j], impacts.value(impacts.segs[s].impact)));
+		sort(entries.begin(), entries.end());
+		for (size_t j = 0; j < entries.size(); ++j)
+		{
+			wdocs.push_back(entries[j].first);
+			wvals.push_back(entries[j].second);
+		}
+	}
+	else
+	{
+		wdocs.assign(postings.docs.begin() + postings.begin(i), postings.docs.begin() + postings.end(i));
+		wvals.assign(postings.vals.begin() + postings.begin(i), postings.vals.begin() + postings.end(i));
+	}
+}
+
+//------------------------------------------------------------------------
+size_t ivFile::stopWords(double maxRatio, size_t maxDocs)
+{
+	if (!(maxRatio > 0 && maxRatio <= 1))
+		throw logic_error("The stop word ratio must be in (0, 1]");
+	this->checkRaw();
+	this->unmap();
+
+	//the words over the limits
+	size_t limit = maxDocs ? maxDocs : this->ndocs;
+	if (maxRatio < 1)
+		limit = min(limit, (size_t)(maxRatio * this->ndocs));
+	size_t nstops = 0;
+	for (size_t i = 0; i < this->nwords; ++i)
+	{
+		ivWord& w = this->words[i];
+		if (!w.stop && postings.end(i) - postings.begin(i) > limit)
+		{
+			w.stop = true;
+			++nstops;
+		}
+	}
+	if (!nstops)
+		return 0;
+
+	//the postings of the others
+	ivPostings out;
+	out.offs.resize(this->nwords + 1);
+	out.offs[0] = 0;
+	for (size_t i = 0; i < this->nwords; ++i)
+		out.offs[i + 1] = out.offs[i] + (this->words[i].stop ? 0 : postings.end(i) - postings.begin(i));
+	out.resize(out.offs[this->nwords]);
+	for (size_t i = 0; i < this->nwords; ++i)
+	{
+		if (this->words[i].stop)
+		{
+			this->words[i].ndocs = 0;
+			continue;
+		}
+		size_t b = postings.begin(i), e = postings.end(i);
+		copy(postings.docs.begin() + b, postings.docs.begin() + e, out.docs.begin() + out.offs[i]);
+		copy(postings.counts.begin() + b, postings.counts.begin() + e, out.counts.begin() + out.offs[i]);
+		copy(postings.vals.begin() + b, postings.vals.begin() + e, out.vals.begin() + out.offs[i]);
+	}
+	postings.swap(out);
+	return nstops;
+}
+
+//------------------------------------------------------------------------
+void ivFile::wordDocs(vector<size_t>& ndocs) const
+{
+	ndocs.resize(this->words.size());
+	for (size_t i = 0; i < this->words.size(); ++i)
+		ndocs[i] = this->words[i].ndocs;
 }
 
 //------------------------------------------------------------------------
@@ -633,6 +2084,8 @@ ostream& operator<<(ostream& os, ivFile const& ivf)
 {
 	uint i;
 
+	ivf.checkRaw();
+
 	os << ivf.params;
 
 	//save the document array
@@ -652,14 +2105,32 @@ ostream& operator<<(ostream& os, ivFile const& ivf)
 		os << ivf.words[i];
 
 	//save the word docs arrays
-	ivWordDocCIt wdit;
+	ivPostings const& ps = ivf.postings;
 	for (i=0; i<ivf.nwords; ++i)
 	{
 		//write for this word
-		for (wdit=ivf.words[i].docs.begin(); wdit != ivf.words[i].docs.end();
-			wdit++)
-			os << *wdit;
+		for (size_t j = ps.begin(i); j < ps.end(i); ++j)
+		{
+			ivWordDoc wd;
+			wd.count = ps.counts[j];
+			wd.doc = ps.docs[j];
+			wd.val = ps.vals[j];
+			os << wd;
+		}
 	}  
+
+	//the stop words, if any
+	vector<uint32_t> stops;
+	for (i=0; i<ivf.nwords; ++i)
+		if (ivf.words[i].stop)
+			stops.push_back(i);
+	if (!stops.empty())
+	{
+		size_t nstops = stops.size();
+		os.write(STOP_MAGIC, sizeof(STOP_MAGIC));
+		os.write((const char*)&nstops, sizeof(nstops));
+		os.write((const char*)&stops[0], nstops * sizeof(stops[0]));
+	}
 	return os;
 }
 
@@ -688,18 +2159,54 @@ istream& operator>>(istream& is, ivFile& ivf)
 	for (i=0; i<ivf.nwords; ++i)
 		is >> ivf.words[i];
 
-	//read the word docs arrays
-	ivWordDocIt wdit;
+	//read the word docs arrays, the sizes of the lists give the offsets
+	ivPostings& ps = ivf.postings;
+	ps.offs.resize(ivf.nwords + 1);
+	ps.offs[0] = 0;
 	for (i=0; i<ivf.nwords; ++i)
+		ps.offs[i + 1] = ps.offs[i] + ivf.words[i].ndocs;
+	if (!is)
+		throw std::runtime_error("Broken inverted file");
+	ps.resize(ps.offs[ivf.nwords]);
+	ivf.mapping.reset();
+	ivf.packed.clear();
+	ivf.impacts.clear();
+
+	for (size_t j = 0; j < ps.docs.size(); ++j)
+	{
+		ivWordDoc wd;
+		is >> wd;
+		ps.docs[j] = (uint32_t)wd.doc;
+		ps.counts[j] = checkCount(wd.count);
+		ps.vals[j] = wd.val;
+	}
+	if (!is)
+		throw std::runtime_error("Broken inverted file");
+
+	//the stop words, files without them end here
+	char magic[sizeof(STOP_MAGIC)];
+	if (is.read(magic, sizeof(magic)))
 	{
-		//get the size of this list
-		uint s = ivf.words[i].ndocs;
-		ivf.words[i].docs.resize(s);
-		//read for this word
-		for (wdit=ivf.words[i].docs.begin(); wdit != ivf.words[i].docs.end();
-			wdit++)
-			is >> *wdit;
+		size_t nstops = 0;
+		is.read((char*)&nstops, sizeof(nstops));
+		if (!equal(magic, magic + sizeof(magic), STOP_MAGIC) || !is || nstops > ivf.nwords)
+			throw std::runtime_error("Broken inverted file");
+		vector<uint32_t> stops(nstops);
+		if (nstops)
+			is.read((char*)&stops[0], nstops * sizeof(stops[0]));
+		if (!is)
+			throw std::runtime_error("Broken inverted file");
+		for (size_t j = 0; j < nstops; ++j)
+		{
+			if (stops[j] >= ivf.nwords)
+				throw std::runtime_error("Broken inverted file");
+			ivf.words[stops[j]].stop = true;
+		}
 	}
+	is.clear();
+
+	ThreadPool pool(ivf.nthreads);
+	ivf.computeWordBounds(pool);
 	return is;
 }
 
@@ -735,6 +2242,8 @@ ostream& operator<<(ostream& os, ivFile::Params const& pr)
 //------------------------------------------------------------------------
 void ivFile::save(string const& filename) const
 {
+	this->checkTarget(filename);
+
 	//open the file for opening
 	ofstream of;
 	of.open(filename.c_str(), ios_base::binary);
@@ -747,6 +2256,75 @@ void ivFile::save(string const& filename) const
 }
 
 
+//------------------------------------------------------------------------
+void ivFile::saveMapped(string const& filename) const
+{
+	this->checkRaw();
+	this->checkTarget(filename);
+
+	ivPostings const& ps = this->postings;
+
+	MapHeader h;
+	memset(&h, 0, sizeof(h));
+	copy(MAP_MAGIC, MAP_MAGIC + sizeof(MAP_MAGIC), h.magic);
+	h.order = 1;
+	h.norm = this->params.norm;
+	h.weight = this->params.weight;
+	h.ndocs = this->ndocs;
+	h.nwords = this->nwords;
+	h.npostings = ps.docs.size();
+
+	//the sections one after the other
+	uint64_t bytes[MAP_LAST];
+	mapBytes(h, bytes);
+	uint64_t at = sizeof(h);
+	for (int i = 0; i < MAP_LAST; ++i)
+	{
+		at = (at + MAP_ALIGN - 1) / MAP_ALIGN * MAP_ALIGN;
+		h.sections[i] = at;
+		at += bytes[i];
+	}
+
+	vector<uint64_t> ntokens(this->ndocs);
+	for (size_t i = 0; i < this->ndocs; ++i)
+		ntokens[i] = this->docs[i].ntokens;
+
+	vector<MapWord> mwords(this->nwords);
+	vector<uint64_t> offs(this->nwords + 1);
+	for (size_t i = 0; i < this->nwords; ++i)
+	{
+		MapWord& mw = mwords[i];
+		memset(&mw, 0, sizeof(mw));
+		mw.ndocs = this->words[i].ndocs;
+		mw.wf = this->words[i].wf;
+		mw.maxval = this->words[i].maxval;
+		mw.minval = this->words[i].minval;
+		mw.stop = this->words[i].stop;
+		offs[i] = ps.begin(i);
+	}
+	offs[this->nwords] = ps.docs.size();
+
+	char const* const data[MAP_LAST] = {
+		(char const*)ntokens.data(), (char const*)mwords.data(), (char const*)offs.data(), 
+		(char const*)ps.docs.begin(), (char const*)ps.vals.begin(), (char const*)ps.counts.begin() };
+
+	ofstream of;
+	of.open(filename.c_str(), ios_base::binary);
+	of.write((char const*)&h, sizeof(h));
+	char const zeros[MAP_ALIGN] = {0};
+	at = sizeof(h);
+	for (int i = 0; i < MAP_LAST; ++i)
+	{
+		of.write(zeros, h.sections[i] - at);
+		if (bytes[i])
+			of.write(data[i], bytes[i]);
+		at = h.sections[i] + bytes[i];
+	}
+	of.close();
+	if (!of)
+		throw std::runtime_error("Can't write " + filename);
+}
+
 //------------------------------------------------------------------------
 void ivFile::load(string const & filename)
 {
@@ -754,6 +2332,17 @@ void ivFile::load(string const & filename)
 	ifstream inf;
 	inf.open(filename.c_str(), ofstream::binary);
 
+	//files in the mapped format are mapped
+	char magic[sizeof(MAP_MAGIC)];
+	if (inf.read(magic, sizeof(magic)) && equal(magic, magic + sizeof(magic), MAP_MAGIC))
+	{
+		inf.close();
+		this->loadMapped(filename);
+		return;
+	}
+	inf.clear();
+	inf.seekg(0);
+
 	inf >> *this;
 
 	//close file
@@ -761,6 +2350,81 @@ void ivFile::load(string const & filename)
 }
 
 
+//------------------------------------------------------------------------
+void ivFile::loadMapped(string const & filename)
+{
+	shared_ptr<ivMapping> map(new ivMapping(filename));
+	char const* base = map->data();
+	size_t size = map->size();
+
+	MapHeader h;
+	if (size < sizeof(h))
+		throw std::runtime_error("Broken inverted file");
+	memcpy(&h, base, sizeof(h));
+	if (!equal(h.magic, h.magic + sizeof(h.magic), MAP_MAGIC))
+		throw std::runtime_error("Broken inverted file");
+	if (h.order != 1)
+		throw std::runtime_error("The inverted file has another byte order");
+
+	//the sections must be in the file, the counts small enough not to 
+	//overflow their bytes
+	uint64_t bytes[MAP_LAST];
+	mapBytes(h, bytes);
+	if (h.ndocs > size || h.nwords > size || h.npostings > size)
+		throw std::runtime_error("Broken inverted file");
+	for (int i = 0; i < MAP_LAST; ++i)
+		if (h.sections[i] % MAP_ALIGN || h.sections[i] > size || bytes[i] > size - h.sections[i])
+			throw std::runtime_error("Broken inverted file");
+
+	this->clear();
+	this->params = Params((Norm)h.norm, (Weight)h.weight);
+	this->ndocs = (size_t)h.ndocs;
+	this->nwords = (size_t)h.nwords;
+
+	//documents and words are copied, they are small
+	uint64_t const* ntokens = (uint64_t const*)(base + h.sections[MAP_DOCS]);
+	this->docs.resize(this->ndocs);
+	for (size_t i = 0; i < this->ndocs; ++i)
+		this->docs[i].ntokens = (size_t)ntokens[i];
+
+	MapWord const* mwords = (MapWord const*)(base + h.sections[MAP_WORDS]);
+	this->words.resize(this->nwords);
+	for (size_t i = 0; i < this->nwords; ++i)
+	{
+		ivWord& w = this->words[i];
+		w.ndocs = (size_t)mwords[i].ndocs;
+		w.wf = (size_t)mwords[i].wf;
+		w.maxval = mwords[i].maxval;
+		w.minval = mwords[i].minval;
+		w.stop = mwords[i].stop != 0;
+	}
+
+	uint64_t const* offs = (uint64_t const*)(base + h.sections[MAP_OFFS]);
+	if (offs[0] != 0 || offs[this->nwords] != h.npostings)
+		throw std::runtime_error("Broken inverted file");
+	for (size_t i = 0; i < this->nwords; ++i)
+		if (offs[i] > offs[i + 1])
+			throw std::runtime_error("Broken inverted file");
+
+	//the postings are views of the file, their documents aren't checked as
+	//that would read all of it
+	ivPostings& ps = this->postings;
+	size_t np = (size_t)h.npostings;
+	if (sizeof(size_t) == sizeof(uint64_t))
+		ps.offs.view((size_t const*)offs, this->nwords + 1);
+	else
+	{
+		ps.offs.resize(this->nwords + 1);
+		for (size_t i = 0; i <= this->nwords; ++i)
+			ps.offs[i] = (size_t)offs[i];
+	}
+	ps.docs.view((uint32_t const*)(base + h.sections[MAP_DOCIDS]), np);
+	ps.vals.view((float const*)(base + h.sections[MAP_VALS]), np);
+	ps.counts.view((uint32_t const*)(base + h.sections[MAP_COUNTS]), np);
+
+	this->mapping = map;
+}
+
 //------------------------------------------------------------------------
 void ivFile::display( bool show_docs/* = true*/, bool show_words/* = false*/ )
 {
@@ -790,12 +2454,10 @@ void ivFile::display( bool show_docs/* = true*/, bool show_words/* = false*/ )
 			cout << "\nWord " << i << ": (ndocs=" << this->words[i].ndocs <<
 				", wf=" << this->words[i].wf << ")\n\t";
 
-			ivWordDocIt wdit;
-			for (wdit=this->words[i].docs.begin(); wdit != this->words[i].docs.end();
-				wdit++)
+			for (size_t j = postings.begin(i); j < postings.end(i); ++j)
 			{
-				cout << "<doc=" << wdit->doc << ", count=" << wdit->count << 
-					", val=" << wdit->val << ">";
+				cout << "<doc=" << postings.docs[j] << ", count=" << postings.counts[j] << 
+					", val=" << postings.vals[j] << ">";
 			}
 		}
 	}
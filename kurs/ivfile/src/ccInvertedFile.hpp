@@ -9,14 +9,22 @@
 #include <vector>
 #include <list>
 #include <deque>
+#include <memory>
 #include <stdint.h>
 
+#include "Util/types.hpp"
+#include "ccImpactPostings.hpp"
+#include "ccMappedFile.hpp"
+#include "ccPackedPostings.hpp"
+
 using namespace std;
 
 
 typedef unsigned int wordtype;
 typedef vector<wordtype> wordvec;
 typedef vector<wordvec> docvec;
+//one word histogram per document
+typedef vector<WordHist> histvec;
 
 //typedef unsigned int uint;
 //typedef size_t uint;
@@ -26,10 +34,13 @@ typedef unsigned long ulong;
 
 #define EPS 1e-10
 
+class ThreadPool;
+
 
 //------------------------------------------------------------------------
 //Inverted file Word Document entry i.e. entry for a given word containing 
-//counts in different documents
+//counts in different documents. The file keeps them in ivPostings, this is
+//the record of the saved file
 class ivWordDoc
 {
 public:
@@ -59,10 +70,39 @@ public:
 	friend istream& operator>>(istream& is, ivWordDoc& ivworddoc);  
 };
 
-//list of ivWordDoc
-typedef vector<ivWordDoc> ivWordDocList;
-typedef vector<ivWordDoc>::iterator ivWordDocIt;
-typedef vector<ivWordDoc>::const_iterator ivWordDocCIt;
+//------------------------------------------------------------------------
+//Document entries of all the words in compressed sparse rows: the entries
+//of word i are offs[i] .. offs[i+1]-1 of the arrays, documents ascending.
+//The arrays are views of the file when it is mapped
+class ivPostings
+{
+public:
+	//largest count, larger ones throw
+	static const uint32_t MAX_COUNT = 0xFFFFFFFF;
+
+	//first entry of every word and the total
+	ivArray<size_t> offs;
+	//document id
+	ivArray<uint32_t> docs;
+	//number of times the word appears in the document
+	ivArray<uint32_t> counts;
+	//weighted value
+	ivArray<float> vals;
+
+	//number of words
+	size_t size() const { return offs.empty() ? 0 : offs.size() - 1; }
+
+	//entries of word i, 0 for words past the end
+	size_t begin(size_t i) const { return i < size() ? offs[i] : docs.size(); }
+	size_t end(size_t i) const { return i < size() ? offs[i + 1] : docs.size(); }
+
+	//allocate the entry arrays
+	void resize(size_t nentries);
+	//copy the viewed arrays to memory
+	void detach();
+	void clear();
+	void swap(ivPostings& other);
+};
 
 //------------------------------------------------------------------------
 // inverted file Word entry
@@ -73,21 +113,20 @@ public:
 	size_t ndocs;
 	//number of times this word appears in the database
 	size_t wf;
-	//documents entries
-	ivWordDocList docs;
+	//largest and smallest value of its documents, not saved
+	float maxval;
+	float minval;
+	//stop word: no documents, skipped by the queries
+	bool stop;
 
 	//constructor
 	ivWord() :
 		ndocs(0),
-		wf(0)
-	{
-		docs.resize(0);
-	}
-
-	//destructor
-	~ivWord()
+		wf(0),
+		maxval(0),
+		minval(0),
+		stop(false)
 	{
-		docs.clear();
 	}
 
 	//stream overloads
@@ -97,9 +136,6 @@ public:
 
 
 //------------------------------------------------------------------------
-typedef vector<uint> ivDocWordList;
-typedef ivDocWordList::iterator ivDocWordIt;
-
 //Inverted file Document entry having information about documents
 class ivDoc
 {
@@ -115,9 +151,6 @@ public:
 	//number of unique words
 	size_t nwords;
 
-	//list of word indices
-	ivDocWordList words;
-
 	//constructor
 	ivDoc() :
 		norml0(0),
@@ -126,13 +159,6 @@ public:
 		ntokens(0),
 		nwords(0)
 	{
-		words.resize(0);
-	}
-
-	//destructor
-	~ivDoc()
-	{
-		words.clear();
 	}
 
 	//stream overloads
@@ -181,6 +207,14 @@ public:
 	bool operator() (const ivNode& i,const ivNode& j) { return (i.val>j.val);} 
 }; 
 
+//class to compare ivNode by val, ties by id
+class ivNodeCmpValIdAsc
+{ 
+public:
+	bool operator() (const ivNode& i,const ivNode& j) const
+	{ return i.val<j.val || (i.val==j.val && i.id<j.id);} 
+}; 
+
 
 //------------------------------------------------------------------------
 //Inverted file structure
@@ -248,11 +282,81 @@ public:
 		friend ostream& operator<<(ostream& os, Params const& pr);
 	};
 
+	//adds documents to the file one at a time. They are kept until a
+	//batch of postings is collected, so only the postings of the file
+	//grow with the corpus
+	class Builder
+	{
+	public:
+		// ivf      - the file, new documents get ids after its ones
+		// nwords   - the total number of words
+		// batch    - postings collected before they are added to the file
+		Builder(ivFile& ivf, uint nwords, size_t batch = 1 << 22);
+		~Builder();
+
+		//the words of the tokens of the next document, 1->nwords
+		void addDocument(const Word* words, size_t ntokens);
+		//the word histogram of the next document
+		void addDocument(WordHist const& hist);
+
+		//adds the rest of the documents and sets the sizes of the file
+		void finish();
+
+	private:
+		void add(WordHist& hist);
+		void flush();
+
+		ivFile& ivf;
+		uint nwords;
+		size_t batch;
+
+		//postings of a batch, the lists of the words it has only. The 
+		//values are 0 until computeStats
+		struct Run
+		{
+			//word index of every list, ascending
+			vector<uint32_t> wids;
+			//first entry of every list and the total
+			vector<size_t> offs;
+			vector<uint32_t> docs;
+			vector<uint32_t> counts;
+		};
+
+		//postings of the batches added so far
+		vector<Run> runs;
+
+		//documents not added yet and their postings
+		histvec pending;
+		size_t npostings;
+		//id of the first pending document
+		size_t idshift;
+
+		vector<Word> tokens;
+		unique_ptr<ThreadPool> pool;
+		//time of the fill phases
+		double times[3];
+	};
+
+	//postings of the query words and the ones skipped by the pruning
+	struct SearchStats
+	{
+		SearchStats() :
+			postings(0),
+			skipped(0)
+		{
+		}
+
+		size_t postings;
+		size_t skipped;
+	};
+
 	//constructor
 	ivFile(ivFile::Params params = ivFile::Params()) :
 		nwords(0),
 		ndocs(0),
-		params(params)
+		params(params),
+		nthreads(1),
+		pruning(false)
 	{ 
 		params.check();
 	}
@@ -267,17 +371,64 @@ public:
 	//write to file
 	void save(string const & filename) const;
 
-	//load from file
+	//write to file in the mapped format: the postings are laid out as they
+	//are in memory, so that load maps them instead of reading them
+	void saveMapped(string const & filename) const;
+
+	//load from file, a file in the mapped format is mapped read only and 
+	//searched in place. Changing its postings copies them to memory first
 	void load(string const & filename);
 
+	bool isMapped() const { return this->mapping.get() != nullptr; }
+
 	void display(bool show_docs = true, bool show_words = false);
 
 	//clears the memory
 	void clear();
 
+	//threads of fill and computeStats, 0 - one per core
+	void setThreads(unsigned threads) { this->nthreads = threads; }
+
+	//weight and norm of the next computeStats
+	void setParams(Params params) { params.check(); this->params = params; }
+
+	//search cos and hist-int a document at a time, skipping the documents 
+	//that can't get into the top k. The results are the same, but it only
+	//pays off when most of the postings are skipped
+	void setPruning(bool prune) { this->pruning = prune; }
+
+	//number of documents of every word, word i at ndocs[i-1]
+	void wordDocs(vector<size_t>& ndocs) const;
+
+	//make stop words of the words in more than maxRatio of the documents,
+	//in (0, 1], or in more than maxDocs documents, 0 - no limit. Their 
+	//postings are dropped, so call it before computeStats. Returns the new
+	//stop words
+	size_t stopWords(double maxRatio, size_t maxDocs);
+
 	//compute stats: document norms, weights, ... to prepare for search
 	void computeStats();
 
+	//compress the postings after computeStats. The values are quantized, so
+	//scores are approximate, and the file can't be filled or saved anymore
+	void compress();
+
+	bool isCompressed() const { return this->packed.size() > 0; }
+
+	//order the postings by impact after computeStats, the values quantized
+	//to 8 bits. Then the cos and hist-int queries take the largest 
+	//contributions first and stop when the k best can't change anymore.
+	//The scores are approximate, and the file can't be filled or saved
+	void impactOrder();
+
+	bool isImpactOrdered() const { return this->impacts.size() > 0; }
+
+	//memory of the postings, raw, compressed or impact ordered
+	size_t indexBytes() const;
+
+	//documents and values of word index i (label i+1)
+	void wordPostings(size_t i, vector<uint32_t>& wdocs, vector<float>& wvals) const;
+
 	//fill the inverted file with input counts
 	//
 	// wlabel   - word labels for every token, 1->nwords
@@ -297,6 +448,14 @@ public:
 	// idshift  - a value to add to document all ids (useful for adding more data)
 	void fill(docvec const & data, uint nwords, uint idshift=0);
 
+	//fill the inverted file with word histograms, the counts are taken as
+	//they are
+	//
+	// data     - one histogram per document, words ascending
+	// nwords   - the total number of words
+	// idshift  - a value to add to document all ids
+	void fill(histvec const & data, uint nwords, uint idshift=0);
+
 	// search the inverted file for the closest document
 	//
 	// data     - the input data, with one vector per iput
@@ -306,12 +465,40 @@ public:
 	// overlapOnly - return only those documents with overlapping words
 	// k        - no. of output required per document, if 0 then return everything
 	// scorelists   - a list of ivNOdeList to hold the results
+	// threads  - threads running the queries, 0 - one per core. With fewer
+	//            queries than threads every query runs on all of them
+	// stats    - gets the postings of the queries and the skipped ones
 	//
 	void search(docvec const & data, 
 		ivFile::Dist dist,
-		bool overlapOnly, uint k, ivNodeLists& scorelists, bool verbose) const;
+		bool overlapOnly, uint k, ivNodeLists& scorelists, bool verbose, 
+		unsigned threads = 1, SearchStats* stats = nullptr) const;
 
 private:
+	//norm terms of the documents for a distance, shared by the queries
+	struct SearchNorms
+	{
+		vector<float> norms;
+		//documents by ascending norm and id, empty if the norms are all equal
+		vector<uint32_t> order;
+	};
+
+	//scores of the documents touched by a query in a range of documents 
+	//starting at first, reset after it
+	struct Accumulator
+	{
+		Accumulator() : first(0), scored(0) {}
+
+		size_t first;
+		//postings scored
+		size_t scored;
+		vector<float> vals;
+		vector<uint8_t> seen;
+		vector<uint32_t> touched;
+	};
+
+	void initSearch(ivFile::Dist dist, bool overlapOnly, SearchNorms& sn) const;
+
 	// search the inverted file for the closest document
 	//
 	// wlabel   - word labels for every token, 1->nwords
@@ -321,23 +508,105 @@ private:
 	// dist     - distance measure to use (L1, L2, ...)
 	// overlapOnly - return only those documents with overlapping words
 	/// k       - no. of outputs required, if 0 then return everything
-	// scorelist - a list of ivNode to hold the results
+	// sn       - norm terms from initSearch
+	// pool     - pool searching the ranges when there are more than one
+	// accs     - accumulators of the document ranges, empty on return
+	// scorelist - a list of ivNode to hold the results, ties go by id
+	// stats    - gets the postings of the query added
 	//
 	void search(const wordtype* wlabel, uint ntokens, 
 		ivFile::Weight weight, ivFile::Norm norm, ivFile::Dist dist,
-		bool overlapOnly, uint k, ivNodeList& scorelist) const;
+		bool overlapOnly, uint k, SearchNorms const& sn, ThreadPool* pool, 
+		vector<Accumulator>& accs, ivNodeList& scorelist, SearchStats& stats) const;
+
+	//add the postings of the query words in the documents acc.first -> last-1
+	//to the accumulator
+	void accumulate(ivNodeList const& wordcount, float docNorm, ivFile::Dist dist, 
+		SearchNorms const& sn, size_t last, Accumulator& acc) const;
+
+	//accumulate for one distance, picked from a table by accumulate
+	template <ivFile::Dist D>
+	void accumulateKernel(ivNodeList const& wordcount, float docNorm, 
+		SearchNorms const& sn, size_t last, Accumulator& acc) const;
+
+	//document at a time search of the documents acc.first -> last-1 into a
+	//heap of the k best, skipping the postings of documents that can't get
+	//into it. For distances 1 - sum of the contributions
+	void maxScore(ivNodeList const& wordcount, ivDoc const& doc, float docNorm, ivFile::Dist dist, 
+		SearchNorms const& sn, uint k, size_t last, Accumulator& acc, ivNodeList& heap) const;
+
+	//score at a time search of the impact ordered postings into a heap of 
+	//the k best: the segments of the query words by descending contribution
+	//until no other document can get into the k best, then the rest of the 
+	//scores of these. For distances 1 - sum of the contributions
+	void impactSearch(ivNodeList const& wordcount, ivDoc const& doc, ivFile::Dist dist, 
+		uint k, Accumulator& acc, ivNodeList& heap) const;
+
+	//distance from the accumulated score of document idoc and query doc
+	inline float finalVal(float val, ivDoc const& idoc, ivDoc const& doc, ivFile::Dist dist) const;
+
+	//push ds to a heap of the k best nodes
+	static void offer(ivNode const& ds, size_t k, ivNodeList& heap);
 
 
+private:
+	//make the postings of the tokens sorted by word, adds up word frequencies
+	//
+	// woffs    - the tokens of word i are sorted[woffs[i]] .. sorted[woffs[i+1]-1]
+	// sorted   - document of every token, ascending within a word
+	// counts   - count of every token, nullptr - ones
+	// run      - the postings
+	void makeRun(ThreadPool& pool, vector<size_t> const& woffs, 
+		vector<uint> const& sorted, vector<uint> const* counts, ivPostings& run);
+
+	//merge the runs into the postings of the file, runs is cleared
+	void addRuns(ThreadPool& pool, vector<ivPostings>& runs);
+
+	//make the postings of word histograms, times gets the count, sort and
+	//postings time if given
+	void makeHistRun(ThreadPool& pool, histvec const& data, uint nwords, uint idshift, 
+		ivPostings& run, double* times);
+
+	//throws when the postings are compressed or impact ordered
+	void checkRaw() const;
+
+	//throws when filename is the file the postings are mapped from, writing
+	//it would pull the postings from under them
+	void checkTarget(string const& filename) const;
+
+	//copy the postings of a mapped file to memory and unmap it, before they
+	//are changed
+	void unmap();
+
+	//load a file in the mapped format
+	void loadMapped(string const & filename);
+
+	//largest and smallest values of the words
+	void computeWordBounds(ThreadPool& pool);
+
+	//weight and normalize all the postings, one instance for every weight
+	//and norm so that the loops don't switch on them for every entry
+	template <ivFile::Weight W>
+	void weighKernel(ThreadPool& pool);
+	template <ivFile::Norm N>
+	void normKernel(ThreadPool& pool);
+
 private:
 		
 	//weight a document value
 	inline float weightVal(float val, ivWord const & word, ivDoc const& doc, ivFile::Weight wt) const;
+	template <ivFile::Weight W>
+	inline float weightVal(float val, ivWord const & word, ivDoc const& doc) const;
 
 	//normalize a document value
 	inline float normVal(float val, ivDoc& doc, ivFile::Norm norm) const;
+	template <ivFile::Norm N>
+	inline float normVal(float val, ivDoc& doc) const;
 
 	//compute distance
 	inline float dist(float val1, float val2, ivFile::Dist dist) const;
+	template <ivFile::Dist D>
+	inline float dist(float val1, float val2) const;
 
 	//convert form a distance to a norm
 	inline float dist2Norm(ivDoc const & doc, ivFile::Dist dist, ivFile::Norm norm) const;
@@ -347,12 +616,26 @@ private:
 	size_t nwords;
 	ivWordList words;
 
+	//their documents
+	ivPostings postings;
+	//or compressed ones
+	ivPacked packed;
+	//or impact ordered ones
+	ivImpacts impacts;
+	//the file the postings are views of, if mapped
+	shared_ptr<ivMapping> mapping;
+
 	//array of document entries
 	size_t ndocs;
 	ivDocList docs;
 
 	Params params;
 
+	//threads of fill and computeStats
+	unsigned nthreads;
+
+	bool pruning;
+
 public:
 
 	//stream overloads
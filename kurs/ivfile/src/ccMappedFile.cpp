@@ -0,0 +1,48 @@
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "ccMappedFile.hpp"
+
+namespace bip = boost::interprocess;
+
+//------------------------------------------------------------------------
+struct ivMapping::Region
+{
+	bip::file_mapping file;
+	bip::mapped_region region;
+};
+
+ivMapping::ivMapping(string const& filename) :
+	filename(filename),
+	base(0),
+	length(0)
+{
+	try
+	{
+		unique_ptr<Region> r(new Region);
+		bip::file_mapping(filename.c_str(), bip::read_only).swap(r->file);
+		bip::mapped_region(r->file, bip::read_only).swap(r->region);
+
+		this->base = static_cast<char const*>(r->region.get_address());
+		this->length = r->region.get_size();
+		this->region.swap(r);
+	}
+	catch (bip::interprocess_exception const& e)
+	{
+		throw std::runtime_error("Can't map " + filename + ": " + e.what());
+	}
+}
+
+ivMapping::~ivMapping()
+{
+}
+
+bool ivMapping::isFile(string const& filename) const
+{
+	//a file that doesn't exist is not this one
+	boost::system::error_code ec;
+	return boost::filesystem::equivalent(this->filename, filename, ec) && !ec;
+}
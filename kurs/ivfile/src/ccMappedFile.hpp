@@ -0,0 +1,130 @@
+#ifndef CC_MAPPEDFILE
+#define CC_MAPPEDFILE
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//------------------------------------------------------------------------
+//Array of items of its own or a view of items it doesn't own, e.g. in a
+//mapped file. A view is read only, resize and assign make it own its items
+//again and detach copies them
+template <class T>
+class ivArray
+{
+public:
+	typedef T value_type;
+	typedef T* iterator;
+	typedef T const* const_iterator;
+
+	ivArray() : p(0), n(0), viewing(false) {}
+	ivArray(ivArray const& other) : own(other.own) { point(other); }
+	ivArray& operator=(ivArray const& other)
+	{
+		own = other.own;
+		point(other);
+		return *this;
+	}
+
+	//view of size items at data, they must outlive it
+	void view(T const* data, size_t size)
+	{
+		vector<T>().swap(own);
+		p = const_cast<T*>(data);
+		n = size;
+		viewing = true;
+	}
+
+	bool isView() const { return viewing; }
+
+	//own a copy of the items of a view
+	void detach()
+	{
+		if (viewing)
+		{
+			own.assign(p, p + n);
+			sync();
+		}
+	}
+
+	size_t size() const { return n; }
+	bool empty() const { return n == 0; }
+
+	T& operator[](size_t i) { return p[i]; }
+	T const& operator[](size_t i) const { return p[i]; }
+
+	T* begin() { return p; }
+	T* end() { return p + n; }
+	T const* begin() const { return p; }
+	T const* end() const { return p + n; }
+
+	void resize(size_t size) { own.resize(size); sync(); }
+	void assign(size_t size, T const& val) { own.assign(size, val); sync(); }
+	void clear() { own.clear(); sync(); }
+
+	void swap(ivArray& other)
+	{
+		own.swap(other.own);
+		std::swap(p, other.p);
+		std::swap(n, other.n);
+		std::swap(viewing, other.viewing);
+	}
+
+private:
+	void sync()
+	{
+		p = own.empty() ? 0 : &own[0];
+		n = own.size();
+		viewing = false;
+	}
+
+	void point(ivArray const& other)
+	{
+		if (other.viewing)
+		{
+			p = other.p;
+			n = other.n;
+			viewing = true;
+		}
+		else
+			sync();
+	}
+
+	vector<T> own;
+	//the items, own or viewed
+	T* p;
+	size_t n;
+	bool viewing;
+};
+
+//------------------------------------------------------------------------
+//A file mapped read only into memory, unmapped by the destructor
+class ivMapping
+{
+public:
+	//throws runtime_error when the file can't be mapped
+	explicit ivMapping(string const& filename);
+	~ivMapping();
+
+	char const* data() const { return this->base; }
+	size_t size() const { return this->length; }
+
+	//whether filename is the mapped file, under any of its names
+	bool isFile(string const& filename) const;
+
+private:
+	ivMapping(ivMapping const&);
+	ivMapping& operator=(ivMapping const&);
+
+	struct Region;
+	unique_ptr<Region> region;
+	string filename;
+	char const* base;
+	size_t length;
+};
+
+#endif
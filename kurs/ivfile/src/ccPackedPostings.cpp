@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+//the SSSE3 decode is compiled for x86 and used when the cpu has it
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64)) || \
+	defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define PACKED_SSSE3
+#endif
+
+#ifdef __GNUC__
+#define PACKED_TARGET __attribute__((target("ssse3")))
+#else
+#define PACKED_TARGET
+#endif
+
+#include "ccPackedPostings.hpp"
+#include "ccInvertedFile.hpp"
+
+#include "Util/util.hpp"
+
+namespace
+{
+	//bytes a SIMD load may read past the last data byte
+	size_t const PADDING = 16;
+
+	//StreamVByte tables: for every control byte the data bytes of its four
+	//values and the shuffle that spreads them to 32 bit lanes
+	struct Tables
+	{
+		uint8_t length[256];
+		uint8_t shuffle[256][16];
+
+		Tables()
+		{
+			for (int c = 0; c < 256; ++c)
+			{
+				int src = 0;
+				for (int k = 0; k < 4; ++k)
+				{
+					int len = ((c >> (2 * k)) & 3) + 1;
+					for (int j = 0; j < 4; ++j)
+						shuffle[c][4 * k + j] = j < len ? (uint8_t)src++ : 0x80;
+				}
+				length[c] = (uint8_t)src;
+			}
+		}
+	};
+
+	Tables const tables;
+
+	int byteLength(uint32_t v)
+	{
+		return v < (1u << 8) ? 1 : v < (1u << 16) ? 2 : v < (1u << 24) ? 3 : 4;
+	}
+
+	//the n documents of a block after the last one of the previous block
+	void decodeDocs(uint8_t const* ctrl, uint8_t const* p, uint32_t n, uint32_t prev, uint32_t* docs)
+	{
+		for (uint32_t j = 0; j < n; ++j)
+		{
+			int len = ((ctrl[j / 4] >> (2 * (j % 4))) & 3) + 1;
+			uint32_t delta = 0;
+			for (int k = 0; k < len; ++k)
+				delta |= (uint32_t)p[k] << (8 * k);
+			p += len;
+			prev += delta;
+			docs[j] = prev;
+		}
+	}
+
+#ifdef PACKED_SSSE3
+	bool const ssse3 = cpuFeatures().ssse3;
+
+	//the same a group of four values at a time, the prefix sum in the
+	//register. Writes the whole last group
+	PACKED_TARGET void decodeDocsSsse3(uint8_t const* ctrl, uint8_t const* p, uint32_t n, 
+		uint32_t base, uint32_t* docs)
+	{
+		__m128i prev = _mm_set1_epi32((int)base);
+		for (size_t g = 0, groups = (n + 3) / 4; g < groups; ++g)
+		{
+			uint8_t c = ctrl[g];
+			__m128i v = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const*>(p)),
+				_mm_loadu_si128(reinterpret_cast<__m128i const*>(tables.shuffle[c])));
+			p += tables.length[c];
+
+			v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+			v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+			v = _mm_add_epi32(v, prev);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(docs + 4 * g), v);
+			prev = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3));
+		}
+	}
+#else
+	bool const ssse3 = false;
+#endif
+}
+
+//------------------------------------------------------------------------
+void ivPacked::build(ivPostings const& ps)
+{
+	clear();
+
+	size_t nw = ps.size();
+	woffs.resize(nw + 1);
+	vals.resize(ps.docs.size());
+
+	for (size_t i = 0; i < nw; ++i)
+	{
+		woffs[i] = blocks.size();
+
+		uint32_t prev = 0;
+		for (size_t b = ps.begin(i), end = ps.end(i); b < end; b += BLOCK)
+		{
+			Block blk;
+			blk.base = prev;
+			blk.n = (uint32_t)min(size_t(BLOCK), end - b);
+			blk.offset = data.size();
+			blk.first = b;
+
+			//control bytes, then the data bytes of the deltas
+			size_t groups = (blk.n + 3) / 4;
+			data.resize(data.size() + groups, 0);
+			for (uint32_t j = 0; j < blk.n; ++j)
+			{
+				uint32_t delta = ps.docs[b + j] - prev;
+				prev = ps.docs[b + j];
+
+				int len = byteLength(delta);
+				data[blk.offset + j / 4] |= (uint8_t)((len - 1) << (2 * (j % 4)));
+				for (int k = 0; k < len; ++k)
+					data.push_back((uint8_t)(delta >> (8 * k)));
+			}
+
+			//values between the block extremes
+			float lo = *min_element(ps.vals.begin() + b, ps.vals.begin() + b + blk.n);
+			float hi = *max_element(ps.vals.begin() + b, ps.vals.begin() + b + blk.n);
+			blk.min = lo;
+			blk.scale = (hi - lo) / 0xFFFF;
+			for (uint32_t j = 0; j < blk.n; ++j)
+				vals[b + j] = blk.scale > 0 ?
+					(uint16_t)min(floor((ps.vals[b + j] - lo) / blk.scale + 0.5f), (float)0xFFFF) : 0;
+
+			blocks.push_back(blk);
+		}
+	}
+	woffs[nw] = blocks.size();
+
+	data.resize(data.size() + PADDING, 0);
+}
+
+//------------------------------------------------------------------------
+size_t ivPacked::decode(size_t b, uint32_t* docs, float* vals) const
+{
+	Block const& blk = blocks[b];
+	size_t groups = (blk.n + 3) / 4;
+	uint8_t const* ctrl = &data[blk.offset];
+	uint8_t const* p = ctrl + groups;
+
+#ifdef PACKED_SSSE3
+	if (ssse3)
+		decodeDocsSsse3(ctrl, p, blk.n, blk.base, docs);
+	else
+#endif
+		decodeDocs(ctrl, p, blk.n, blk.base, docs);
+
+	uint16_t const* q = &this->vals[blk.first];
+	for (uint32_t j = 0; j < blk.n; ++j)
+		vals[j] = blk.min + q[j] * blk.scale;
+
+	return blk.n;
+}
+
+//------------------------------------------------------------------------
+size_t ivPacked::bytes() const
+{
+	return woffs.size() * sizeof(woffs[0]) + blocks.size() * sizeof(Block) +
+		data.size() + vals.size() * sizeof(vals[0]);
+}
+
+void ivPacked::clear()
+{
+	woffs.clear();
+	blocks.clear();
+	data.clear();
+	vals.clear();
+}
+
+void ivPacked::swap(ivPacked& other)
+{
+	woffs.swap(other.woffs);
+	blocks.swap(other.blocks);
+	data.swap(other.data);
+	vals.swap(other.vals);
+}
+
+bool ivPacked::simd()
+{
+	return ssse3;
+}
@@ -0,0 +1,69 @@
+#ifndef CC_PACKEDPOSTINGS
+#define CC_PACKEDPOSTINGS
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+class ivPostings;
+
+//------------------------------------------------------------------------
+//Compressed document entries of all the words. The entries of a word are
+//cut into blocks of BLOCK, the document ids of a block are delta coded with
+//StreamVByte and its values quantized to 16 bits between the block minimum
+//and maximum. Counts are not kept
+class ivPacked
+{
+public:
+	static const size_t BLOCK = 128;
+
+	struct Block
+	{
+		//last document of the previous block of the word, 0 for the first
+		uint32_t base;
+		//number of entries
+		uint32_t n;
+		//control bytes of the block in data, its data bytes follow them
+		size_t offset;
+		//first entry of the block in vals
+		size_t first;
+		//value of quantization level 0 and the step between levels
+		float min;
+		float scale;
+	};
+
+	//first block of every word and the total
+	vector<size_t> woffs;
+	vector<Block> blocks;
+	//control and data bytes of the blocks, padded for the SIMD loads
+	vector<uint8_t> data;
+	//quantized values
+	vector<uint16_t> vals;
+
+	//number of words
+	size_t size() const { return woffs.empty() ? 0 : woffs.size() - 1; }
+
+	//blocks of word i, none for words past the end
+	size_t begin(size_t i) const { return i < size() ? woffs[i] : blocks.size(); }
+	size_t end(size_t i) const { return i < size() ? woffs[i + 1] : blocks.size(); }
+
+	//compress the postings
+	void build(ivPostings const& ps);
+
+	//decode block b into docs and vals, both of at least BLOCK entries.
+	//Returns the number of entries
+	size_t decode(size_t b, uint32_t* docs, float* vals) const;
+
+	//memory of the compressed entries
+	size_t bytes() const;
+
+	void clear();
+	void swap(ivPacked& other);
+
+	//true when decode uses SIMD instructions
+	static bool simd();
+};
+
+#endif
@@ -1,35 +1,71 @@
 #include <exception>
 #include <fstream>
 #include <iostream>
+#include <string>
+#include <vector>
 
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/path.hpp>
+#include <boost/program_options.hpp>
 
 #include <Image/Image.hpp>
-#include "HIKMTree/HIKMTree.hpp"
+#include "HIKMTree/AKMVocab.hpp"
+#include "HIKMTree/Quantizer.hpp"
 #include "Util/util.hpp"
 
 namespace bfs = boost::filesystem;
+namespace bpo = boost::program_options;
 
 
-void print_help(char const* pname)
+void print_help(char const* pname, bpo::options_description const & desc)
 {
-	std::cout << pname << " tree_infile sift_infile words_outfile" << std::endl;
+	std::cout << pname << " [options] tree_infile sift_infile words_outfile" << std::endl;
+	std::cout << desc << std::endl;
 }
 
 int main(int argc, char* argv[])
 {
 	TRACE;
 
-	if (argc != 4)
+	std::vector<std::string> files;
+	int checks = 0;
+
+	bpo::options_description desc("");
+	desc.add_options()
+		("help,h", "Help message")
+		("checks", bpo::value(&checks), "Centers compared per descriptor lookup of an AKM vocabulary, default - the trained one")
+		;
+
+	bpo::options_description all("");
+	all.add(desc).add_options()
+		("files", bpo::value(&files))
+		;
+
+	bpo::positional_options_description p;
+	p.add("files", -1);
+
+	bpo::variables_map vm;
+	try
 	{
-		print_help(argv[0]);
+		bpo::store(bpo::command_line_parser(argc, argv).options(all).positional(p).run(), vm);
+		bpo::notify(vm);
+	}
+	catch (std::exception& e)
+	{
+		std::cerr << e.what() << std::endl;
+		print_help(argv[0], desc);
 		return 1;
 	}
 
-	bfs::path tree_i(argv[1]);
-	bfs::path sift_i(argv[2]);
-	bfs::path word_o(argv[3]);
+	if (vm.count("help") || files.size() != 3)
+	{
+		print_help(argv[0], desc);
+		return vm.count("help") ? 0 : 1;
+	}
+
+	bfs::path tree_i(files[0]);
+	bfs::path sift_i(files[1]);
+	bfs::path word_o(files[2]);
 
 	if (!(bfs::exists(tree_i) && bfs::is_regular_file(tree_i)))
 	{
@@ -48,10 +84,16 @@ int main(int argc, char* argv[])
 		Image i("");
 		i.loadDescr(sift_i.string());
 
-		HIKMTree tree(1,2,3);
-		tree.load(tree_i.string());
+		auto tree = Quantizer::open(tree_i.string());
+		if (vm.count("checks"))
+		{
+			AKMVocab* akm = dynamic_cast<AKMVocab*>(tree.get());
+			if (!akm)
+				throw std::runtime_error("--checks needs an AKM vocabulary");
+			akm->setChecks(checks);
+		}
 
-		tree.push(i);
+		tree->push(i);
 
 		i.save(word_o.string());
 	}
@@ -7,7 +7,8 @@
 #include <boost/program_options.hpp>
 
 #include "Sift/Sift.hpp"
-#include "HIKMTree/HIKMTree.hpp"
+#include "HIKMTree/AKMVocab.hpp"
+#include "HIKMTree/Quantizer.hpp"
 #include "ivfile/src/ccInvertedFile.hpp"
 #include "Image/Image.hpp"
 #include "Util/util.hpp"
@@ -20,7 +21,7 @@ using std::string;
 
 
 
-void calc_words(Image& img, HIKMTree& tree)
+void calc_words(Image& img, Quantizer& tree)
 {
 	TRACE;
 	img.open();
@@ -28,7 +29,7 @@ void calc_words(Image& img, HIKMTree& tree)
 	tree.push(img);
 }
 
-void make_query(Image& img, HIKMTree& tree, ivFile& ivf, ivFile::Dist& dist, std::ostream& out)
+void make_query(Image& img, Quantizer& tree, ivFile& ivf, ivFile::Dist& dist, std::ostream& out)
 {
 	TRACE;
 
@@ -77,6 +78,7 @@ int main(int argc, char* argv[]) try
 	string invfname;
 	string ofname;
 	ivFile::Dist dist = ivFile::DIST_L1;
+	int checks = 0;
 
 	bpo::options_description desc("");
 	desc.add_options()
@@ -91,6 +93,7 @@ int main(int argc, char* argv[]) try
 	bpo::options_description optParams("Parameters");
 	optParams.add_options()
 		("dist,D", bpo::value(&dist), "Distance function in ivf")
+		("checks", bpo::value(&checks), "Centers compared per descriptor lookup of an AKM vocabulary, default - the trained one")
 		;
 
 	desc.add(optParams);
@@ -127,8 +130,14 @@ int main(int argc, char* argv[]) try
 	if (!checkFile(invfname))
 		throw std::runtime_error(invfname + " not found");
 
-	HIKMTree tree(1,2,3);
-	tree.load(tfname);
+	auto tree = Quantizer::open(tfname);
+	if (vm.count("checks"))
+	{
+		AKMVocab* akm = dynamic_cast<AKMVocab*>(tree.get());
+		if (!akm)
+			throw std::runtime_error("--checks needs an AKM vocabulary");
+		akm->setChecks(checks);
+	}
 
 	ivFile ivf;
 	ivf.load(invfname);
@@ -139,7 +148,7 @@ int main(int argc, char* argv[]) try
 	{
 		if (!checkFile(ifname))
 			throw std::runtime_error(ifname + " not found");
-		calc_words(img, tree);
+		calc_words(img, *tree);
 	}
 	else
 	{
@@ -149,12 +158,12 @@ int main(int argc, char* argv[]) try
 	}
 
 	if (ofname == "--")
-		make_query(img, tree, ivf, dist, cout);
+		make_query(img, *tree, ivf, dist, cout);
 	else
 	{
 		ofstream ofs;
 		ofs.open(ofname);
-		make_query(img, tree, ivf, dist, ofs);
+		make_query(img, *tree, ivf, dist, ofs);
 		ofs.close();
 	}
 
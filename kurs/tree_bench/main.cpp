@@ -0,0 +1,124 @@
+#include <exception>
+#include <iostream>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include "Image/Image.hpp"
+#include "HIKMTree/HIKMTree.hpp"
+#include "Util/opts.hpp"
+#include "Util/util.hpp"
+
+typedef std::vector<std::string> str_vector;
+
+// Pushes the descriptors of the sift files through every tree with and
+// without the inter-center pruning and compares the time, the distances
+// computed and the words.
+
+void prepare(int argc, char* argv[], str_vector& trees, str_vector& sift_infiles, int& repeat)
+{
+	bpo::options_description desc("");
+	desc.add_options()
+		("help,h", "Help message")
+		("tree,t", bpo::value(&trees)->required(), "Tree files, e.g. K=10 and K=16 ones")
+		("input,i", bpo::value(&sift_infiles)->required(), "Sift descriptors input files")
+		("repeat,r", bpo::value(&repeat)->default_value(3), "Runs of every mode, the best one is reported")
+		;
+
+	bpo::positional_options_description p;
+	p.add("input", -1);
+
+	bpo::variables_map vm;
+	bpo::store(bpo::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
+	if (vm.count("help"))
+	{
+		std::cout << desc << std::endl;
+		exit(0);
+	}
+
+	bpo::notify(vm);
+}
+
+double run(HIKMTree& tree, std::vector<SiftDescr> const & descr, bool prune, int repeat,
+	std::vector<Word>& words, HIKMTree::PushStats& stats)
+{
+	size_t count = descr.size() / 128;
+	words.resize(count);
+	tree.setPruning(prune);
+
+	double best = 0;
+	for (int r = 0; r < repeat; ++r)
+	{
+		stats = HIKMTree::PushStats();
+
+		Timer timer;
+		timer.tic();
+		for (size_t i = 0; i < count; ++i)
+			tree.push(&descr[i * 128], words[i], stats);
+		double t = timer.toc();
+
+		if (r == 0 || t < best)
+			best = t;
+	}
+	return best;
+}
+
+int main(int argc, char* argv[]) try
+{
+	str_vector trees;
+	str_vector sift_infiles;
+	int repeat = 3;
+
+	prepare(argc, argv, trees, sift_infiles, repeat);
+
+	std::vector<SiftDescr> descr;
+	for (auto it = sift_infiles.begin(); it != sift_infiles.end(); ++it)
+	{
+		if (!checkFile(*it))
+			throw std::runtime_error(*it + " not found");
+
+		Image img("");
+		img.loadDescr(*it);
+		descr.insert(descr.end(), img.getDescr(), img.getDescr() + 128 * img.getDescrCount());
+	}
+	size_t count = descr.size() / 128;
+	if (!count)
+		throw std::runtime_error("No descriptors");
+
+	for (auto it = trees.begin(); it != trees.end(); ++it)
+	{
+		if (!checkFile(*it))
+			throw std::runtime_error(*it + " not found");
+
+		HIKMTree tree(*it);
+
+		std::vector<Word> full, pruned;
+		HIKMTree::PushStats fullStats, prunedStats;
+		double tfull = run(tree, descr, false, repeat, full, fullStats);
+		double tpruned = run(tree, descr, true, repeat, pruned, prunedStats);
+
+		size_t differ = 0;
+		for (size_t i = 0; i < count; ++i)
+			differ += full[i] != pruned[i];
+
+		std::cout << *it << ": K " << tree.Clusters() << ", depth " << tree.Depth()
+			<< ", words " << tree.maxWord() << ", descriptors " << count << '\n'
+			<< "  full:   " << tfull << " s, " << (double)fullStats.computed / count << " distances per descriptor\n"
+			<< "  pruned: " << tpruned << " s, " << (double)prunedStats.computed / count << " distances per descriptor, "
+			<< prunedStats.skipped << " skipped ("
+			<< 100.0 * prunedStats.skipped / (prunedStats.computed + prunedStats.skipped) << "%)\n"
+			<< "  speedup " << (tpruned > 0 ? tfull / tpruned : 0.0) << ", words differ " << differ << std::endl;
+	}
+
+	return 0;
+}
+catch (std::exception& e)
+{
+	std::cerr << "Error: " << e.what() << std::endl;
+	return 10;
+}
+catch (...)
+{
+	std::cerr << "Something awfull" << std::endl;
+	return 11;
+}
@@ -1,20 +1,91 @@
+#include <algorithm>
 #include <exception>
 #include <fstream>
 #include <iostream>
+#include <random>
 #include <vector>
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
 #include "Image/Image.hpp"
+#include "HIKMTree/AKMVocab.hpp"
 #include "HIKMTree/HIKMTree.hpp"
 #include "Util/opts.hpp"
+#include "Util/threads.hpp"
 #include "Util/util.hpp"
+#include "ivfile/src/ccInvertedFile.hpp"
 
 namespace bfs = boost::filesystem;
 
 typedef std::vector<std::string> str_vector;
 
+struct SampleParams
+{
+	SampleParams() :
+		maxTrain(0),
+		perImageCap(0),
+		memory(1 << 24)
+	{
+	}
+
+	// maximum number of training descriptors, 0 - all of them
+	size_t maxTrain;
+	// maximum number of descriptors taken from one image, 0 - all of them
+	size_t perImageCap;
+
+	// directory for the out-of-core training files, empty - train in memory
+	std::string outOfCore;
+	// descriptors a node may hold in memory during out-of-core training
+	size_t memory;
+};
+
+struct RefineParams
+{
+	RefineParams() :
+		iters(3)
+	{
+	}
+
+	// tree the training starts from, empty - train from scratch
+	std::string init;
+	// refinement iterations of every node
+	int iters;
+};
+
+struct SplitParams
+{
+	SplitParams() :
+		maxLeaf(0),
+		maxDocs(0),
+		passes(4)
+	{
+	}
+
+	// training descriptors a word may hold, 0 - don't split
+	size_t maxLeaf;
+	// documents a word of the ivf may occur in
+	size_t maxDocs;
+	// inverted file built with the tree, gives the documents of every word
+	std::string ivf;
+	// tree to split instead of training a new one
+	std::string tree;
+	// maximum number of split passes
+	int passes;
+};
+
+std::istream& operator>>(std::istream& is, HIKMTree::Method& method)
+{
+	std::string str;
+	is >> str;
+	if      (str == "lloyd")   method = HIKMTree::METHOD_LLOYD;
+	else if (str == "elkan")   method = HIKMTree::METHOD_ELKAN;
+	else if (str == "hamerly") method = HIKMTree::METHOD_HAMERLY;
+	else 
+		throw std::runtime_error("Unknown k-means method " + str);
+	return is;
+}
+
 void read_inlist_file(std::string const & file, str_vector & list)
 {
 	TRACE;
@@ -32,7 +103,9 @@ void read_inlist_file(std::string const & file, str_vector & list)
 	ifs.close();
 }
 
-void prepare(int argc, char* argv[], std::string& ofname, str_vector& sift_infiles, HIKMTree::Params& hikmParams) 
+void prepare(int argc, char* argv[], std::string& ofname, std::string& statsFname, str_vector& sift_infiles, std::string& type, 
+	HIKMTree::Params& hikmParams, AKMVocab::Params& akmParams, SampleParams& sampleParams, RefineParams& refineParams,
+	SplitParams& splitParams) 
 {
 	std::string inlist_file;
 	std::string config;
@@ -41,21 +114,67 @@ void prepare(int argc, char* argv[], std::string& ofname, str_vector& sift_infil
 	desc.add_options()
 		("help,h", "Help message")
 		("output,o", bpo::value(&ofname)->required(), "Output tree file")
+		("stats", bpo::value(&statsFname), "Per-node training records output file, JSON lines")
 		("list,l", bpo::value(&inlist_file), "File with the list of input sift files")
 		("input,i", bpo::value(&sift_infiles), "Sift descriptors input files")
 		("config,c", bpo::value(&config), "Config file")
 		;
 
+	type = "hikm";
+
 	bpo::options_description optParams("Tree parameters");
 	optParams.add_options()
+		("type,T", bpo::value(&type)->default_value(type), "Vocabulary type: hikm - hierarchical tree, akm - flat approximate k-means")
 		("clustres,C", bpo::value(&hikmParams.clusters)->default_value(hikmParams.clusters), "Count of clusters on each level")
 		("leaves,L", bpo::value(&hikmParams.leaves)->default_value(hikmParams.leaves), "Maximum number of leaves")
+		("method,m", bpo::value(&hikmParams.method)->default_value(hikmParams.method, "elkan"), "K-means of the nodes: lloyd, elkan or hamerly")
+		("threads,j", bpo::value(&hikmParams.threads)->default_value(hikmParams.threads), "Training threads, 0 - one per core")
+		("seed,s", bpo::value(&hikmParams.seed)->default_value(hikmParams.seed), "Seed of the centers initialization")
+		;
+
+	bpo::options_description optAkm("Flat vocabulary parameters");
+	optAkm.add_options()
+		("words,W", bpo::value(&akmParams.words)->default_value(akmParams.words), "Count of words")
+		("iters", bpo::value(&akmParams.iters)->default_value(akmParams.iters), "Maximum number of k-means iterations")
+		("trees", bpo::value(&akmParams.trees)->default_value(akmParams.trees), "Count of kd-trees over the centers")
+		("checks", bpo::value(&akmParams.checks)->default_value(akmParams.checks), "Centers compared per descriptor lookup")
+		;
+
+	bpo::options_description optRefine("Warm start");
+	optRefine.add_options()
+		("init", bpo::value(&refineParams.init), "Start from the centers of this tree")
+		("refine-iters", bpo::value(&refineParams.iters)->default_value(refineParams.iters), "Refinement iterations of every node")
+		;
+
+	bpo::options_description optSample("Training sample");
+	optSample.add_options()
+		("max-train", bpo::value(&sampleParams.maxTrain)->default_value(sampleParams.maxTrain), "Maximum number of training descriptors, 0 - all")
+		("per-image-cap", bpo::value(&sampleParams.perImageCap)->default_value(sampleParams.perImageCap), "Maximum number of descriptors from one image, 0 - all")
+		("out-of-core", bpo::value(&sampleParams.outOfCore), "Train over descriptor files in this directory instead of memory")
+		("memory", bpo::value(&sampleParams.memory)->default_value(sampleParams.memory), "Descriptors a node may hold in memory when training out-of-core")
+		;
+
+	bpo::options_description optSplit("Leaf splitting");
+	optSplit.add_options()
+		("max-leaf", bpo::value(&splitParams.maxLeaf)->default_value(splitParams.maxLeaf), "Training descriptors of a word, more are split into a new level, 0 - off")
+		("max-docs", bpo::value(&splitParams.maxDocs)->default_value(splitParams.maxDocs), "Documents of a word, words of longer --ivf lists are split, 0 - off")
+		("ivf", bpo::value(&splitParams.ivf), "Inverted file built with the tree being split")
+		("split", bpo::value(&splitParams.tree), "Split the leaves of this tree instead of training one")
+		("split-passes", bpo::value(&splitParams.passes)->default_value(splitParams.passes), "Maximum number of split passes")
 		;
 
 	desc.add(optParams);
+	desc.add(optAkm);
+	desc.add(optRefine);
+	desc.add(optSample);
+	desc.add(optSplit);
 
 	bpo::options_description config_file_options;
 	config_file_options.add(optParams);
+	config_file_options.add(optAkm);
+	config_file_options.add(optRefine);
+	config_file_options.add(optSample);
+	config_file_options.add(optSplit);
 
 	bpo::positional_options_description p;
 	p.add("input", -1);
@@ -76,6 +195,36 @@ void prepare(int argc, char* argv[], std::string& ofname, str_vector& sift_infil
 	bpo::notify(vm);
 
 	conflicting_options(vm, "input", "list");
+	conflicting_options(vm, "out-of-core", "max-train");
+	conflicting_options(vm, "out-of-core", "init");
+	conflicting_options(vm, "out-of-core", "split");
+	conflicting_options(vm, "split", "init");
+	option_dependency(vm, "ivf", "max-docs");
+	option_dependency(vm, "max-docs", "ivf");
+
+	if (type != "hikm" && type != "akm")
+		throw std::runtime_error("Unknown vocabulary type " + type);
+	if (type == "akm" && vm.count("out-of-core"))
+		throw std::logic_error("akm vocabulary can't be trained out-of-core");
+	if (type == "akm" && vm.count("init"))
+		throw std::logic_error("akm vocabulary can't be warm started");
+	if (vm.count("init") && !checkFile(refineParams.init))
+		throw std::runtime_error(refineParams.init + " not found");
+	if (type == "akm" && (splitParams.maxLeaf || vm.count("split") || vm.count("ivf")))
+		throw std::logic_error("akm vocabulary has no leaves to split");
+	if (splitParams.maxLeaf && vm.count("out-of-core"))
+		throw std::logic_error("Leaves can't be split out-of-core");
+	if (vm.count("split") && !splitParams.maxLeaf && !splitParams.maxDocs)
+		throw std::logic_error("--split needs --max-leaf or a non-zero --max-docs");
+	if (vm.count("ivf") && !vm.count("split"))
+		throw std::logic_error("--ivf needs the tree it was built with, --split");
+	if (vm.count("split") && !checkFile(splitParams.tree))
+		throw std::runtime_error(splitParams.tree + " not found");
+	if (vm.count("ivf") && !checkFile(splitParams.ivf))
+		throw std::runtime_error(splitParams.ivf + " not found");
+
+	akmParams.threads = hikmParams.threads;
+	akmParams.seed = hikmParams.seed;
 
 	if (vm.count("input"))
 	{
@@ -88,51 +237,272 @@ void prepare(int argc, char* argv[], std::string& ofname, str_vector& sift_infil
 	}
 }
 
-void readSiftInFilese( str_vector &sift_infiles, std::vector<SiftDescr> &all_descr ) 
+size_t readDescrCount(std::string const & inf)
+{
+	std::ifstream is;
+	is.open(inf.c_str(), std::ifstream::binary);
+	size_t count = 0;
+	READ(count);
+	if (!is)
+		throw std::runtime_error(inf + " is not a sift file");
+	return count;
+}
+
+// uniform subset of at most cap of the count image descriptors, returns its size
+size_t imageSubset(size_t count, size_t cap, std::mt19937_64& rng, std::vector<size_t>& perm)
+{
+	size_t take = cap ? std::min(count, cap) : count;
+	perm.resize(count);
+	for (size_t j = 0; j < count; ++j)
+		perm[j] = j;
+	if (take < count)
+	{
+		for (size_t j = 0; j < take; ++j)
+			std::swap(perm[j], perm[j + rng() % (count - j)]);
+		std::sort(perm.begin(), perm.begin() + take);
+	}
+	return take;
+}
+
+// Streams the descriptors of the files into all_descr. When there are more 
+// than sampleParams.maxTrain of them a uniform reservoir sample is kept, so
+// only one image and the sample are in memory at a time.
+void readSiftInFilese( str_vector &sift_infiles, std::vector<SiftDescr> &all_descr, 
+	SampleParams const & sampleParams, unsigned seed ) 
 {
 	TRACE;
 
+	size_t const cap = sampleParams.perImageCap;
+
+	// the headers give the exact size of the sample
+	size_t total = 0;
 	for (auto it = sift_infiles.begin(); it != sift_infiles.end(); ++it)
 	{
 		std::string const & inf = *it;
 		if (!checkFile(inf))
 			throw std::runtime_error(inf + " not found");
 
+		size_t count = readDescrCount(inf);
+		total += cap ? std::min(count, cap) : count;
+	}
+
+	size_t const sample = sampleParams.maxTrain ? std::min(total, sampleParams.maxTrain) : total;
+	all_descr.assign(sample * 128, 0);
+
+	std::mt19937_64 rng(seed);
+	std::vector<size_t> perm;
+	size_t seen = 0;
+
+	for (auto it = sift_infiles.begin(); it != sift_infiles.end(); ++it)
+	{
 		Image img("");
-		img.loadDescr(inf);
+		img.loadDescr(*it);
 
 		SiftDescr const * descr = img.getDescr();
 		size_t descrCount = img.getDescrCount();
 
-		all_descr.reserve(all_descr.size() + descrCount * 128 * sizeof(SiftDescr));
+		size_t take = imageSubset(descrCount, cap, rng, perm);
 
-		for (int j = 0; j < descrCount; ++j)
+		for (size_t j = 0; j < take; ++j, ++seen)
 		{
-			const auto b = descr + 128*j;
-			const auto e = b + 128;
-			all_descr.insert(all_descr.end(), b, e);
+			// reservoir sampling: the seen-th descriptor replaces a random
+			// one with probability sample / seen
+			size_t slot = seen < sample ? seen : rng() % (seen + 1);
+			if (slot >= sample)
+				continue;
+
+			SiftDescr const * b = descr + 128 * perm[j];
+			std::copy(b, b + 128, &all_descr[128 * slot]);
 		}
 	}
+
+	std::cerr << "training descriptors: " << sample << " of " << total << '\n';
 }
+
+// Concatenates the descriptors of the files into one raw file for the
+// out-of-core training, one image at a time.
+void writeSiftInFilese( str_vector &sift_infiles, std::string const & ofname, 
+	SampleParams const & sampleParams, unsigned seed ) 
+{
+	TRACE;
+
+	std::ofstream os;
+	os.open(ofname.c_str(), std::ofstream::binary);
+	if (!os)
+		throw std::runtime_error("Cannot create " + ofname);
+
+	std::mt19937_64 rng(seed);
+	std::vector<size_t> perm;
+	size_t total = 0;
+
+	for (auto it = sift_infiles.begin(); it != sift_infiles.end(); ++it)
+	{
+		std::string const & inf = *it;
+		if (!checkFile(inf))
+			throw std::runtime_error(inf + " not found");
+
+		Image img("");
+		img.loadDescr(inf);
+
+		SiftDescr const * descr = img.getDescr();
+		size_t take = imageSubset(img.getDescrCount(), sampleParams.perImageCap, rng, perm);
+
+		for (size_t j = 0; j < take; ++j)
+			os.write(reinterpret_cast<char const *>(descr + 128 * perm[j]), 128);
+		total += take;
+	}
+
+	os.close();
+	if (!os)
+		throw std::runtime_error("Cannot write " + ofname);
+
+	std::cerr << "training descriptors: " << total << '\n';
+}
+
+// How much the refined tree differs from the initial one: moved leaf
+// centers and training descriptors that take another path now.
+void reportChanges(HIKMTree const & tree, HIKMTree const & init, 
+	std::vector<SiftDescr> const & all_descr, unsigned threads)
+{
+	TRACE;
+
+	std::cerr << "moved words: " << tree.movedWords(init) << " of " << tree.maxWord() << '\n';
+
+	size_t count = all_descr.size() / 128;
+	size_t changed = 0;
+	boost::mutex mutex;
+	ThreadPool pool(threads);
+	parallelFor(pool, 0, count, 4096, [&](size_t b, size_t e)
+	{
+		std::vector<unsigned int> a, c;
+		size_t local = 0;
+		for (size_t i = b; i < e; ++i)
+		{
+			tree.push(&all_descr[i * 128], a);
+			init.push(&all_descr[i * 128], c);
+			local += a != c;
+		}
+		boost::lock_guard<boost::mutex> lock(mutex);
+		changed += local;
+	});
+
+	std::cerr << "reassigned descriptors: " << changed << " of " << count 
+		<< " (" << (count ? 100.0 * changed / count : 0.0) << "%)\n";
+}
+
+// Splits the crowded leaves of the tree. Words are renumbered, so the word
+// and inverted files of the tree have to be made again.
+void splitLeaves(HIKMTree& tree, std::vector<SiftDescr> const & all_descr, SplitParams const & splitParams)
+{
+	TRACE;
+
+	size_t words = tree.maxWord();
+	size_t split;
+	if (splitParams.ivf.empty())
+	{
+		split = tree.split(all_descr, splitParams.maxLeaf, nullptr, 0, splitParams.passes);
+	}
+	else
+	{
+		ivFile ivf;
+		ivf.load(splitParams.ivf);
+
+		std::vector<size_t> ndocs;
+		ivf.wordDocs(ndocs);
+		if (ndocs.size() != words)
+			throw std::runtime_error(splitParams.ivf + " was not built with the tree");
+
+		split = tree.split(all_descr, splitParams.maxLeaf, &ndocs, splitParams.maxDocs, splitParams.passes);
+	}
+
+	std::cerr << "split words: " << split << ", words: " << words << " -> " << tree.maxWord() << '\n';
+}
+
 int main(int argc, char* argv[]) try
 {
 	TRACE;
 
 	std::string ofname;
+	std::string statsFname;
 	str_vector sift_infiles;
+	std::string type;
 	HIKMTree::Params hikmParams;
+	AKMVocab::Params akmParams;
+	SampleParams sampleParams;
+	RefineParams refineParams;
+	SplitParams splitParams;
 
-	prepare(argc, argv, ofname, sift_infiles, hikmParams);
+	prepare(argc, argv, ofname, statsFname, sift_infiles, type, hikmParams, akmParams, sampleParams, refineParams, splitParams);
 	
 	bfs::path ouf(ofname);
 
-	std::vector <SiftDescr> all_descr;
+	if (type == "akm")
+	{
+		std::vector <SiftDescr> all_descr;
+
+		readSiftInFilese(sift_infiles, all_descr, sampleParams, akmParams.seed);
+
+		AKMVocab vocab(akmParams);
+		vocab.train(all_descr);
+		vocab.save(ouf.string());
+		return 0;
+	}
+
+	if (!splitParams.tree.empty())
+	{
+		std::vector <SiftDescr> all_descr;
 
-	readSiftInFilese(sift_infiles, all_descr);
+		readSiftInFilese(sift_infiles, all_descr, sampleParams, hikmParams.seed);
 
+		HIKMTree tree(splitParams.tree);
+		tree.setThreads(hikmParams.threads);
+		splitLeaves(tree, all_descr, splitParams);
+		tree.save(ouf.string());
+		return 0;
+	}
 
 	HIKMTree tree(hikmParams);
-	tree.train(all_descr);
+
+	std::ofstream stats;
+	if (!statsFname.empty())
+	{
+		stats.open(statsFname.c_str());
+		if (!stats)
+			throw std::runtime_error("Cannot create " + statsFname);
+		tree.setTrainLog(&stats);
+	}
+
+	if (sampleParams.outOfCore.empty())
+	{
+		std::vector <SiftDescr> all_descr;
+
+		readSiftInFilese(sift_infiles, all_descr, sampleParams, hikmParams.seed);
+
+		if (refineParams.init.empty())
+		{
+			tree.train(all_descr);
+		}
+		else
+		{
+			HIKMTree init(refineParams.init);
+			tree.train(all_descr, init, refineParams.iters);
+			reportChanges(tree, init, all_descr, hikmParams.threads);
+		}
+
+		if (splitParams.maxLeaf)
+			splitLeaves(tree, all_descr, splitParams);
+	}
+	else
+	{
+		// runs sharing the directory don't meet, the files go on errors too
+		TempDir tmp(sampleParams.outOfCore);
+		std::string descr = (bfs::path(tmp.path) / "train.descr").string();
+
+		writeSiftInFilese(sift_infiles, descr, sampleParams, hikmParams.seed);
+
+		tree.train(descr, tmp.path, sampleParams.memory);
+	}
+
 	tree.save(ouf.string());
 
 	return 0;